@@ -2,6 +2,7 @@
 #include "SceneRendering.h"
 #include "ScenePrivate.h"
 #include "PixelShaderUtils.h"
+#include "RenderGraphUtils.h"
 
 #define SL_USE_MOBILEHZB 1
 
@@ -26,11 +27,84 @@ TAutoConsoleVariable<int32> CVarMobileUseSceneDepth(
 	ECVF_RenderThreadSafe
 );
 
+TAutoConsoleVariable<int32> CVarMobileHZBResolution(
+	TEXT("r.GpuDriven.MobileHZB.Resolution"),
+	FMobileHzbSystem::kHzbTexWidth,
+	TEXT("StorageBuffer HZB mip 0 width, height follows the view aspect ratio. 0 uses half of the ViewRect (full resolution)"),
+	ECVF_RenderThreadSafe
+);
+
+TAutoConsoleVariable<int32> CVarMobileHZBBufferBuildMode(
+	TEXT("r.GpuDriven.MobileHZB.BufferBuildMode"),
+	0,
+	TEXT("StorageBuffer build: 0 two dispatches (LevelZero + LevelOne), 1 single dispatch, last group reduces the remaining mips"),
+	ECVF_RenderThreadSafe
+);
+
+TAutoConsoleVariable<int32> CVarMobileHZBMinMax(
+	TEXT("r.GpuDriven.MobileHZB.MinMax"),
+	0,
+	TEXT("StorageBuffer HZB also reduces the closest depth in the same pass, stored as a second plane after the furthest chain"),
+	ECVF_RenderThreadSafe
+);
+
+TAutoConsoleVariable<int32> CVarMobileHZBFP16(
+	TEXT("r.GpuDriven.MobileHZB.FP16"),
+	0,
+	TEXT("StorageBuffer HZB packs two FP16 texels per uint, furthest depth rounded toward the far plane so quantization never culls a visible object"),
+	ECVF_RenderThreadSafe
+);
+
+TAutoConsoleVariable<int32> CVarMobileHZBTiledLayout(
+	TEXT("r.GpuDriven.MobileHZB.TiledLayout"),
+	0,
+	TEXT("StorageBuffer HZB stores every mip as 4x4 texel tiles instead of rows, the query taps and the LevelOne 2x2 reads share cache lines"),
+	ECVF_RenderThreadSafe
+);
+
+TAutoConsoleVariable<int32> CVarMobileHZBBatchViews(
+	TEXT("r.GpuDriven.MobileHZB.BatchViews"),
+	1,
+	TEXT("Build the StorageBuffer HZB of all views (split screen, stereo) with one dispatch sequence, view index from group Z"),
+	ECVF_RenderThreadSafe
+);
+
+TAutoConsoleVariable<int32> CVarMobileHZBAsyncCompute(
+	TEXT("r.GpuDriven.MobileHZB.AsyncCompute"),
+	0,
+	TEXT("Run the compute HZB build on the async compute pipe where the RHI supports it efficiently, overlaps the graphics passes of the same graph"),
+	ECVF_RenderThreadSafe
+);
+
+TAutoConsoleVariable<int32> CVarMobileHZBWaveOps(
+	TEXT("r.GpuDriven.MobileHZB.WaveOps"),
+	1,
+	TEXT("Reduce the first mips of every compute HZB build with quad wave operations instead of LDS and barriers where the RHI supports them"),
+	ECVF_RenderThreadSafe
+);
+
+TAutoConsoleVariable<int32> CVarMobileHZBReadbackDepth(
+	TEXT("r.GpuDriven.MobileHZB.ReadbackDepth"),
+	0,
+	TEXT("Number of frames the HZB readback ring keeps in flight, 0 disables the CPU readback"),
+	ECVF_RenderThreadSafe
+);
+
+TAutoConsoleVariable<int32> CVarMobileHZBReadbackFirstMip(
+	TEXT("r.GpuDriven.MobileHZB.ReadbackFirstMip"),
+	3,
+	TEXT("First HZB mip copied back to the CPU, mips 3+ of 256x128 are only a few KB"),
+	ECVF_RenderThreadSafe
+);
+
 
 DECLARE_CYCLE_STAT(TEXT("HZBOcclusion Generator"), STAT_CLMM_HZBOcclusionGenerator, STATGROUP_CommandListMarkers);
 DECLARE_CYCLE_STAT(TEXT("HZBOcclusion Submit"), STAT_CLMM_HZBCopyOcclusionSubmit, STATGROUP_CommandListMarkers);
+//Mip 0-3 (or the whole chain for the single pass build) and the mip batches after it, every dispatch keeps its own RDG event for r.ProfileGPU
+DECLARE_GPU_STAT(MobileHZBBuild);
+DECLARE_GPU_STAT(MobileHZBReduceMips);
 
-TMap<uint32, TUniquePtr<FMobileHzbSystem>> FMobileHzbSystem::ViewUniqueId2HzbSystemMap;
+FMobileHzbSystemRegistry FMobileHzbSystem::SystemRegistry;
 
 BEGIN_SHADER_PARAMETER_STRUCT(FMobileHZBParameters, )
 	SHADER_PARAMETER(FVector2D, ParentTextureInvSize)
@@ -45,10 +119,9 @@ class FMobileHZBBuildPS : public FGlobalShader
 	DECLARE_GLOBAL_SHADER(FMobileHZBBuildPS);
 	SHADER_USE_PARAMETER_STRUCT(FMobileHZBBuildPS, FGlobalShader)
 
-	class FDimSceneDepth : SHADER_PERMUTATION_BOOL("FDimSceneDepth"); //第一个Pass,从alpha中取LinearDepth
 	class FUseSceneDepth : SHADER_PERMUTATION_BOOL("UseSceneDepth"); 
 
-	using FPermutationDomain = TShaderPermutationDomain<FDimSceneDepth, FUseSceneDepth>;
+	using FPermutationDomain = TShaderPermutationDomain<FUseSceneDepth>;
 
 	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
 		SHADER_PARAMETER_STRUCT_INCLUDE(FMobileHZBParameters, Shared)
@@ -57,9 +130,14 @@ class FMobileHZBBuildPS : public FGlobalShader
 
 	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
 	{
-		return true;
+		return FMobileHzbSystem::ShouldCompileTextureShaders(Parameters);
 	}
 
+	static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment)
+	{
+		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+		FMobileHzbSystem::ModifyHzbCompilationEnvironment(OutEnvironment);
+	}
 };
 	
 void FMobileHzbSystem::ReduceMips(FRDGTextureSRVRef RDGTexutreMip, FRDGTextureRef RDGFurthestHZBTexture, const FViewInfo& View, FRDGBuilder& GraphBuilder, uint32 CurOutHzbMipLevel) {
@@ -81,7 +159,6 @@ void FMobileHzbSystem::ReduceMips(FRDGTextureSRVRef RDGTexutreMip, FRDGTextureRe
 	PassParameters->RenderTargets[0] = FRenderTargetBinding(RDGFurthestHZBTexture, ERenderTargetLoadAction::ENoAction, CurOutHzbMipLevel);
 
 	FMobileHZBBuildPS::FPermutationDomain PermutationVector;
-	PermutationVector.Set<FMobileHZBBuildPS::FDimSceneDepth>(CurOutHzbMipLevel == 0);  //use SceneTexture Only Mipmap is 0 
 	PermutationVector.Set<FMobileHZBBuildPS::FUseSceneDepth>(CVarMobileUseSceneDepth.GetValueOnAnyThread() != 0);
 
 	TShaderMapRef<FMobileHZBBuildPS> PixelShader(View.ShaderMap, PermutationVector);
@@ -96,21 +173,8 @@ void FMobileHzbSystem::ReduceMips(FRDGTextureSRVRef RDGTexutreMip, FRDGTextureRe
 	);
 }
 
-void FMobileHzbSystem::MobileRasterBuildHZB(FRHICommandListImmediate& RHICmdList, const FViewInfo& View) {
-
-	const FSceneRenderTargets& SceneContext = FSceneRenderTargets::Get(RHICmdList);
-
-	FRDGBuilder GraphBuilder(RHICmdList);
-	TRefCountPtr<IPooledRenderTarget> SceneTexture;
-	if (CVarMobileUseSceneDepth.GetValueOnAnyThread() != 0) {
-		SceneTexture = SceneContext.SceneDepthZ;	
-	}
-	else {
-		SceneTexture = SceneContext.GetSceneColor();
-	}
-
-	FRDGTextureRef RDGSceneTexutre = GraphBuilder.RegisterExternalTexture(SceneTexture, TEXT("RDGSceneTexture"));
-	FRDGTextureSRVRef RDGSceneTexutreMip = GraphBuilder.CreateSRV(FRDGTextureSRVDesc::CreateForMipLevel(RDGSceneTexutre, 0));
+void FMobileHzbSystem::AddRasterBuildHZBPasses(FRDGBuilder& GraphBuilder, const FViewInfo& View, FRDGTextureRef SceneTexture) {
+	FRDGTextureSRVRef RDGSceneTexutreMip = GraphBuilder.CreateSRV(FRDGTextureSRVDesc::CreateForMipLevel(SceneTexture, 0));
 
 	//RG的FRDGTextureSRVDesc也是封装FRHITextureSRVCreateInfo,也可以直接手动管理
 	FRDGTextureRef RDGFurthestHZBTexture = GraphBuilder.RegisterExternalTexture(MobileHZBTexture);
@@ -124,264 +188,582 @@ void FMobileHzbSystem::MobileRasterBuildHZB(FRHICommandListImmediate& RHICmdList
 
 	// Update the view. this only used for SceneOcclusion, no need 
 	//View.HZBMipmap0Size = HzbSize;
-	GraphBuilder.Execute();
+	//Texture consumers outside the graph sample it as SRV
+	GraphBuilder.QueueTextureExtraction(RDGFurthestHZBTexture, &MobileHZBTexture, ERHIAccess::SRVCompute);
 }
 
-class FMobileHZBBuildCSLevel0 : public FGlobalShader
-{
-	DECLARE_GLOBAL_SHADER(FMobileHZBBuildCSLevel0);
-
-	class FUseSceneDepth : SHADER_PERMUTATION_BOOL("UseSceneDepth");
-	using FPermutationDomain = TShaderPermutationDomain<FUseSceneDepth>;
+//HzbMipLayout[HZB_MAX_MIP_COUNT], NumMips and ViewBaseOffset[HZB_MAX_VIEW_COUNT] of MobileBufferHZB.usf
+BEGIN_SHADER_PARAMETER_STRUCT(FMobileHzbBufferLayoutParameters, )
+	SHADER_PARAMETER_ARRAY(FUintVector4, HzbMipLayout, [FMobileHzbBufferLayout::kMaxMipCount])
+	SHADER_PARAMETER(uint32, NumMips)
+	SHADER_PARAMETER_ARRAY(FUintVector4, ViewBaseOffset, [FMobileHzbBuildViews::kMaxViews])
+END_SHADER_PARAMETER_STRUCT()
 
-public:
-	FMobileHZBBuildCSLevel0() : FGlobalShader() {}
-	FMobileHZBBuildCSLevel0(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
-		: FGlobalShader(Initializer) {
+//ParentSceneTexture and ViewParentUVScaleBias[HZB_MAX_VIEW_COUNT] of the builds reading the scene
+BEGIN_SHADER_PARAMETER_STRUCT(FMobileHzbSceneTextureParameters, )
+	SHADER_PARAMETER_RDG_TEXTURE(Texture2D, ParentSceneTexture)
+	SHADER_PARAMETER_SAMPLER(SamplerState, ParentSceneTextureSampler)
+	SHADER_PARAMETER_ARRAY(FVector4, ViewParentUVScaleBias, [FMobileHzbBuildViews::kMaxViews])
+	SHADER_PARAMETER(FVector2D, ParentDeviceZScaleBias)
+END_SHADER_PARAMETER_STRUCT()
 
-		ParentSceneTexture.Bind(Initializer.ParameterMap, TEXT("ParentSceneTexture"));
-		ParentSceneTextureSampler.Bind(Initializer.ParameterMap, TEXT("ParentSceneTextureSampler"));
-		HzbStructuredBufferUAV.Bind(Initializer.ParameterMap, TEXT("HzbStructuredBufferUAV_Zero"));
+static void SetHzbBufferLayoutParameters(FMobileHzbBufferLayoutParameters& OutParameters, const FMobileHzbBufferLayout& Layout, const FMobileHzbBuildViews& BuildViews) {
+	FUintVector4 MipLayout[FMobileHzbBufferLayout::kMaxMipCount];
+	Layout.GetShaderMipLayout(MipLayout);
+	for (int32 MipLevel = 0; MipLevel < FMobileHzbBufferLayout::kMaxMipCount; ++MipLevel) {
+		OutParameters.HzbMipLayout[MipLevel] = MipLayout[MipLevel];
+	}
+	OutParameters.NumMips = Layout.NumMips;
+	for (int32 ViewIndex = 0; ViewIndex < FMobileHzbBuildViews::kMaxViews; ++ViewIndex) {
+		OutParameters.ViewBaseOffset[ViewIndex] = BuildViews.BaseOffset[ViewIndex];
 	}
+}
 
-	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters) {
-		return true;
+static void SetHzbSceneTextureParameters(FMobileHzbSceneTextureParameters& OutParameters, FRDGTextureRef SceneTexture, const FMobileHzbBuildViews& BuildViews, const bool bLightViewHzb) {
+	OutParameters.ParentSceneTexture = SceneTexture;
+	//Shadow depth is not inverted, 0 sits at the light
+	OutParameters.ParentDeviceZScaleBias = bLightViewHzb ? FVector2D(-1.f, 1.f) : FVector2D(1.f, 0.f);
+	OutParameters.ParentSceneTextureSampler = TStaticSamplerState<SF_Point, AM_Clamp, AM_Clamp, AM_Clamp>::GetRHI();
+	for (int32 ViewIndex = 0; ViewIndex < FMobileHzbBuildViews::kMaxViews; ++ViewIndex) {
+		OutParameters.ViewParentUVScaleBias[ViewIndex] = BuildViews.ParentUVScaleBias[ViewIndex];
 	}
+}
+
+bool FMobileHzbSystem::ShouldCompileBufferShaders(const FGlobalShaderPermutationParameters& Parameters) {
+	return !bUseTextureResources && IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::ES3_1);
+}
+
+bool FMobileHzbSystem::ShouldCompileTextureShaders(const FGlobalShaderPermutationParameters& Parameters) {
+	return bUseTextureResources && IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::ES3_1);
+}
 
-	void BindParameters(FRHICommandList& RHICmdList, const FViewInfo& View, const FTextureRHIRef& SceneTexture, const FRWBufferStructured& HzbStructuredBuffer) {
-		// There are cases where we ping-pong images between UAVCompute and SRVCompute. In that case it may be more efficient to leave the image in VK_IMAGE_LAYOUT_GENERAL
-		// (at the very least, it will mean fewer image barriers). There's no good way to detect this though, so it might be better if the high level code just did UAV
-		// to UAV transitions in that case, instead of SRV <-> UAV.
-		RHICmdList.Transition(FRHITransitionInfo(HzbStructuredBuffer.UAV, ERHIAccess::SRVCompute, ERHIAccess::UAVCompute)); //WAR
-		SetTextureParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), ParentSceneTexture, SceneTexture);
-		SetSamplerParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), ParentSceneTextureSampler, TStaticSamplerState<SF_Point, AM_Clamp, AM_Clamp, AM_Clamp>::GetRHI());
-		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), HzbStructuredBufferUAV, HzbStructuredBuffer.UAV);
+void FMobileHzbSystem::ModifyHzbCompilationEnvironment(FShaderCompilerEnvironment& OutEnvironment) {
+	FString FixedMipOffsets;
+	for (int32 MipLevel = 0; MipLevel < kHZBMaxMipmap; ++MipLevel) {
+		FixedMipOffsets += FString::Printf(MipLevel == 0 ? TEXT("%uu") : TEXT(", %uu"), GetFixedMipOffset(MipLevel));
 	}
+	OutEnvironment.SetDefine(TEXT("HIZ_SIZE_WIDTH"), kHzbTexWidth);
+	OutEnvironment.SetDefine(TEXT("HIZ_SIZE_HEIGHT"), kHzbTexHeight);
+	OutEnvironment.SetDefine(TEXT("HZB_FIXED_MIP_COUNT"), int32(kHZBMaxMipmap));
+	OutEnvironment.SetDefine(TEXT("HZB_FIXED_MIP_OFFSETS"), *FixedMipOffsets);
+	OutEnvironment.SetDefine(TEXT("HZB_MAX_MIP_COUNT"), FMobileHzbBufferLayout::kMaxMipCount);
+	OutEnvironment.SetDefine(TEXT("HZB_TILE_SIZE"), FMobileHzbBufferLayout::kTileSize);
+	OutEnvironment.SetDefine(TEXT("HZB_MAX_VIEW_COUNT"), FMobileHzbBuildViews::kMaxViews);
+}
 
+//Quad ops need lanes in SV_GroupIndex order and at least one full quad per wave, the LDS path stays the fallback.
+//The RHI flag alone is not enough, the permutation is only compiled for platforms RHISupportsWaveOperations accepts
+static bool UseHzbWaveOps(const EShaderPlatform ShaderPlatform) {
+	return GRHISupportsWaveOperations && RHISupportsWaveOperations(ShaderPlatform) && GRHIMinimumWaveSize >= 4 && CVarMobileHZBWaveOps.GetValueOnRenderThread() != 0;
+}
+
+//HZB_WAVE_OPS permutations exist only on platforms that compile wave intrinsics
+template<typename TWaveOpsDimension, typename TPermutationDomain>
+static bool ShouldCompileHzbWaveOpsPermutation(const FGlobalShaderPermutationParameters& Parameters) {
+	const TPermutationDomain PermutationVector(Parameters.PermutationId);
+	return !PermutationVector.template Get<TWaveOpsDimension>() || RHISupportsWaveOperations(Parameters.Platform);
+}
 
-	void UnBindParameters(FRHICommandList& RHICmdList) {
-		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), HzbStructuredBufferUAV, nullptr);
+template<typename TWaveOpsDimension, typename TPermutationDomain>
+static void ModifyHzbWaveOpsCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment) {
+	const TPermutationDomain PermutationVector(Parameters.PermutationId);
+	if (PermutationVector.template Get<TWaveOpsDimension>()) {
+		OutEnvironment.CompilerFlags.Add(CFLAG_WaveOperations);
 	}
+}
 
-private:
+//Async compute lets the build overlap the graphics passes recorded after it in the same graph (translucency)
+static ERDGPassFlags GetHzbBuildPassFlags() {
+	return GSupportsEfficientAsyncCompute && CVarMobileHZBAsyncCompute.GetValueOnRenderThread() != 0 ? ERDGPassFlags::AsyncCompute : ERDGPassFlags::Compute;
+}
 
-	LAYOUT_FIELD(FShaderResourceParameter, ParentSceneTexture);
-	LAYOUT_FIELD(FShaderResourceParameter, ParentSceneTextureSampler);
-	LAYOUT_FIELD(FShaderResourceParameter, HzbStructuredBufferUAV);
+static FRDGTextureRef RegisterHzbSceneTexture(FRDGBuilder& GraphBuilder, FRHICommandListImmediate& RHICmdList) {
+	const FSceneRenderTargets& SceneContext = FSceneRenderTargets::Get(RHICmdList);
+	const TRefCountPtr<IPooledRenderTarget> SceneTexture = CVarMobileUseSceneDepth.GetValueOnRenderThread() != 0 ? SceneContext.SceneDepthZ : SceneContext.GetSceneColor();
+	return GraphBuilder.RegisterExternalTexture(SceneTexture, TEXT("MobileHZBSceneTexture"));
+}
+
+//HZB mip 0 texel -> SceneTexture UV, the HZB covers only the ViewRect
+static FVector4 GetParentUVScaleBias(const FViewInfo& View, const FIntPoint SceneTextureExtent, const FIntPoint HzbSize) {
+	const FVector2D InvExtent(1.f / SceneTextureExtent.X, 1.f / SceneTextureExtent.Y);
+	return FVector4(
+		float(View.ViewRect.Width()) / HzbSize.X * InvExtent.X,
+		float(View.ViewRect.Height()) / HzbSize.Y * InvExtent.Y,
+		View.ViewRect.Min.X * InvExtent.X,
+		View.ViewRect.Min.Y * InvExtent.Y);
+}
+
+class FMobileHZBBuildCSLevel0 : public FGlobalShader
+{
+	DECLARE_GLOBAL_SHADER(FMobileHZBBuildCSLevel0);
+	SHADER_USE_PARAMETER_STRUCT(FMobileHZBBuildCSLevel0, FGlobalShader)
+
+public:
+	class FUseSceneDepth : SHADER_PERMUTATION_BOOL("UseSceneDepth");
+	class FMinMax : SHADER_PERMUTATION_BOOL("HZB_MIN_MAX");
+	class FPackedFP16 : SHADER_PERMUTATION_BOOL("HZB_FP16");
+	class FTiled : SHADER_PERMUTATION_BOOL("HZB_TILED");
+	class FWaveOps : SHADER_PERMUTATION_BOOL("HZB_WAVE_OPS");
+	using FPermutationDomain = TShaderPermutationDomain<FUseSceneDepth, FMinMax, FPackedFP16, FTiled, FWaveOps>;
+
+	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
+		SHADER_PARAMETER_STRUCT_INCLUDE(FMobileHzbBufferLayoutParameters, Layout)
+		SHADER_PARAMETER_STRUCT_INCLUDE(FMobileHzbSceneTextureParameters, SceneTexture)
+		SHADER_PARAMETER(FIntPoint, GroupOffset)
+		SHADER_PARAMETER_RDG_BUFFER_UAV(RWStructuredBuffer<float>, HzbStructuredBufferUAV_Zero)
+	END_SHADER_PARAMETER_STRUCT()
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters) {
+		return FMobileHzbSystem::ShouldCompileBufferShaders(Parameters) && ShouldCompileHzbWaveOpsPermutation<FWaveOps, FPermutationDomain>(Parameters);
+	}
+
+	static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment) {
+		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+		FMobileHzbSystem::ModifyHzbCompilationEnvironment(OutEnvironment);
+		ModifyHzbWaveOpsCompilationEnvironment<FWaveOps, FPermutationDomain>(Parameters, OutEnvironment);
+	}
 };
 
 class FMobileHZBBuildCSLevel1 : public FGlobalShader
 {
 	DECLARE_GLOBAL_SHADER(FMobileHZBBuildCSLevel1);
+	SHADER_USE_PARAMETER_STRUCT(FMobileHZBBuildCSLevel1, FGlobalShader)
 
 public:
+	class FMinMax : SHADER_PERMUTATION_BOOL("HZB_MIN_MAX");
+	class FPackedFP16 : SHADER_PERMUTATION_BOOL("HZB_FP16");
+	class FTiled : SHADER_PERMUTATION_BOOL("HZB_TILED");
+	class FWaveOps : SHADER_PERMUTATION_BOOL("HZB_WAVE_OPS");
+	using FPermutationDomain = TShaderPermutationDomain<FMinMax, FPackedFP16, FTiled, FWaveOps>;
 
-	FMobileHZBBuildCSLevel1() : FGlobalShader() {}
-
-	FMobileHZBBuildCSLevel1(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
-		: FGlobalShader(Initializer) {
-		HzbStructuredBufferUAV.Bind(Initializer.ParameterMap, TEXT("HzbStructuredBufferUAV_One"));
-	}
+	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
+		SHADER_PARAMETER_STRUCT_INCLUDE(FMobileHzbBufferLayoutParameters, Layout)
+		SHADER_PARAMETER(uint32, StartMipLevel)
+		SHADER_PARAMETER(FIntPoint, GroupOffset)
+		SHADER_PARAMETER_RDG_BUFFER_UAV(RWStructuredBuffer<float>, HzbStructuredBufferUAV_One)
+	END_SHADER_PARAMETER_STRUCT()
 
 	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters) {
-		return true;
+		return FMobileHzbSystem::ShouldCompileBufferShaders(Parameters) && ShouldCompileHzbWaveOpsPermutation<FWaveOps, FPermutationDomain>(Parameters);
 	}
 
-	void BindParameters(FRHICommandList& RHICmdList, const FViewInfo& View, const FRWBufferStructured& HzbStructuredBuffer) {
-		RHICmdList.Transition(FRHITransitionInfo(HzbStructuredBuffer.UAV, ERHIAccess::UAVCompute, ERHIAccess::UAVCompute)); //WAW
-		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), HzbStructuredBufferUAV, HzbStructuredBuffer.UAV);
+	static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment) {
+		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+		FMobileHzbSystem::ModifyHzbCompilationEnvironment(OutEnvironment);
+		ModifyHzbWaveOpsCompilationEnvironment<FWaveOps, FPermutationDomain>(Parameters, OutEnvironment);
 	}
+};
+
+class FMobileHZBBuildCSSinglePass : public FGlobalShader
+{
+	DECLARE_GLOBAL_SHADER(FMobileHZBBuildCSSinglePass);
+	SHADER_USE_PARAMETER_STRUCT(FMobileHZBBuildCSSinglePass, FGlobalShader)
+
+public:
+	class FUseSceneDepth : SHADER_PERMUTATION_BOOL("UseSceneDepth");
+	class FMinMax : SHADER_PERMUTATION_BOOL("HZB_MIN_MAX");
+	class FPackedFP16 : SHADER_PERMUTATION_BOOL("HZB_FP16");
+	class FTiled : SHADER_PERMUTATION_BOOL("HZB_TILED");
+	class FWaveOps : SHADER_PERMUTATION_BOOL("HZB_WAVE_OPS");
+	using FPermutationDomain = TShaderPermutationDomain<FUseSceneDepth, FMinMax, FPackedFP16, FTiled, FWaveOps>;
+
+	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
+		SHADER_PARAMETER_STRUCT_INCLUDE(FMobileHzbBufferLayoutParameters, Layout)
+		SHADER_PARAMETER_STRUCT_INCLUDE(FMobileHzbSceneTextureParameters, SceneTexture)
+		SHADER_PARAMETER(uint32, NumGroups)
+		SHADER_PARAMETER_RDG_BUFFER_UAV(RWStructuredBuffer<float>, HzbStructuredBufferUAV_Zero)
+		SHADER_PARAMETER_RDG_BUFFER_UAV(RWBuffer<uint>, HzbAtomicCounterUAV)
+	END_SHADER_PARAMETER_STRUCT()
 
-	void UnBindParameters(FRHICommandList& RHICmdList) {
-		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), HzbStructuredBufferUAV, nullptr);
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters) {
+		return FMobileHzbSystem::ShouldCompileBufferShaders(Parameters) && ShouldCompileHzbWaveOpsPermutation<FWaveOps, FPermutationDomain>(Parameters);
 	}
 
-private:
-	LAYOUT_FIELD(FShaderResourceParameter, HzbStructuredBufferUAV);
+	static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment) {
+		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+		FMobileHzbSystem::ModifyHzbCompilationEnvironment(OutEnvironment);
+		ModifyHzbWaveOpsCompilationEnvironment<FWaveOps, FPermutationDomain>(Parameters, OutEnvironment);
+		OutEnvironment.SetDefine(TEXT("SINGLE_PASS_BUILD"), 1);
+	}
 };
 
 class FMobileTextureBuildCS : public FGlobalShader
 {
 	DECLARE_GLOBAL_SHADER(FMobileTextureBuildCS);
+	SHADER_USE_PARAMETER_STRUCT(FMobileTextureBuildCS, FGlobalShader)
 
+public:
 	class FDimMipLevelCount : SHADER_PERMUTATION_RANGE_INT("DIM_MIP_LEVEL_COUNT", 1, FMobileHzbSystem::ComputeShaderBuildBatch);
-	using FPermutationDomain = TShaderPermutationDomain<FDimMipLevelCount>;
+	class FWaveOps : SHADER_PERMUTATION_BOOL("HZB_WAVE_OPS");
+	using FPermutationDomain = TShaderPermutationDomain<FDimMipLevelCount, FWaveOps>;
 
-public:
-	FMobileTextureBuildCS() : FGlobalShader() {}
-	FMobileTextureBuildCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
-		: FGlobalShader(Initializer) {
-		ParentTextureMip.Bind(Initializer.ParameterMap, TEXT("ParentTextureMip"), EShaderParameterFlags::SPF_Mandatory);
-		ParentTextureMipSampler.Bind(Initializer.ParameterMap, TEXT("ParentTextureMipSampler"), EShaderParameterFlags::SPF_Mandatory);
-		ParentTextureInvSize.Bind(Initializer.ParameterMap, TEXT("ParentTextureInvSize"), EShaderParameterFlags::SPF_Mandatory);
-		ViewRectSizeMinsOne.Bind(Initializer.ParameterMap, TEXT("ViewRectSizeMinsOne"), EShaderParameterFlags::SPF_Mandatory);
-		FirstDownSampleBuild.Bind(Initializer.ParameterMap, TEXT("FirstDownSampleBuild"), EShaderParameterFlags::SPF_Mandatory);
-		FurthestMipOutput_0.Bind(Initializer.ParameterMap, TEXT("FurthestMipOutput_0"), EShaderParameterFlags::SPF_Optional);
-		FurthestMipOutput_1.Bind(Initializer.ParameterMap, TEXT("FurthestMipOutput_1"), EShaderParameterFlags::SPF_Optional);
-		FurthestMipOutput_2.Bind(Initializer.ParameterMap, TEXT("FurthestMipOutput_2"), EShaderParameterFlags::SPF_Optional);
-		FurthestMipOutput_3.Bind(Initializer.ParameterMap, TEXT("FurthestMipOutput_3"), EShaderParameterFlags::SPF_Optional);
-	}
+	//FurthestMipOutput_0..3, only the first DIM_MIP_LEVEL_COUNT are bound
+	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
+		SHADER_PARAMETER_STRUCT_INCLUDE(FMobileHZBParameters, Shared)
+		SHADER_PARAMETER(uint32, FirstDownSampleBuild)
+		SHADER_PARAMETER_RDG_TEXTURE_UAV_ARRAY(RWTexture2D<float>, FurthestMipOutput, [FMobileHzbSystem::ComputeShaderBuildBatch])
+	END_SHADER_PARAMETER_STRUCT()
 
 	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters) {
-		return true;
-	}
-
-	void BindParameters(
-		FRHICommandList& RHICmdList, 
-		const FViewInfo& View, 
-		const FIntPoint CurrentStartHzbTextureSize,
-		const TRefCountPtr<IPooledRenderTarget>& SceneTexture,
-		const FShaderResourceViewRHIRef& ParentTextureSRV,
-		const TArray<FUnorderedAccessViewRHIRef>& InMipUAVs,
-		const int32 CurrentMipLevel,
-		const int32 CurrentBatchMipLevelCount)
-	{
-		FShaderResourceParameter ShaderResourcesArray[4] = { FurthestMipOutput_0, FurthestMipOutput_1, FurthestMipOutput_2, FurthestMipOutput_3 };
-		TArray<FRHITransitionInfo> TextureCSBuildBarriers;
-		if (CurrentMipLevel != 0) {
-			TextureCSBuildBarriers.Emplace(FRHITransitionInfo(InMipUAVs[CurrentMipLevel - 1], ERHIAccess::UAVCompute, ERHIAccess::SRVCompute));
-		}
-
-		for (int32 Index = 0; Index < CurrentBatchMipLevelCount; ++Index) {
-			TextureCSBuildBarriers.Emplace(FRHITransitionInfo(InMipUAVs[CurrentMipLevel + Index], ERHIAccess::SRVCompute, ERHIAccess::UAVCompute)); //WAR
-		}
-		RHICmdList.Transition(MakeArrayView(TextureCSBuildBarriers.GetData(), TextureCSBuildBarriers.Num()));
-		
-		//DX11RHI will clear the SRV of the corresponding resource when set UAV
-		for (int32 Index = 0; Index < CurrentBatchMipLevelCount; ++Index) {
-			SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), ShaderResourcesArray[Index], InMipUAVs[CurrentMipLevel + Index]);
-		}
-
-		if (CurrentMipLevel == 0) {
-			SetTextureParameter(
-				RHICmdList, 
-				RHICmdList.GetBoundComputeShader(), 
-				ParentTextureMip, 
-				ParentTextureMipSampler, 
-				TStaticSamplerState<SF_Point, AM_Clamp, AM_Clamp, AM_Clamp>::GetRHI(), 
-				SceneTexture->GetRenderTargetItem().ShaderResourceTexture);
-		}
-		else {
-			SetSRVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), ParentTextureMip, ParentTextureSRV);
-			SetSamplerParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), ParentTextureMipSampler, TStaticSamplerState<SF_Point, AM_Clamp, AM_Clamp, AM_Clamp>::GetRHI());
-		}
-			
-		FIntPoint ParentTextureSrcSize;
-		FIntPoint ViewRectSizeMinsOneParameter;
-		uint32 FirstDownSampleBuildParameter = 0;
-
-		if (CurrentMipLevel == 0) {
-			if (!FMobileHzbSystem::bUseFullResolution) {
-				ParentTextureSrcSize = CurrentStartHzbTextureSize;
-				FirstDownSampleBuildParameter = 1;
-				ViewRectSizeMinsOneParameter = FIntPoint::ZeroValue;
-			}
-			else {
-				ParentTextureSrcSize = SceneTexture->GetDesc().Extent;
-				ViewRectSizeMinsOneParameter = View.ViewRect.Size() - FIntPoint(1, 1);
-			}
-		}
-		else {
-			ParentTextureSrcSize = CurrentStartHzbTextureSize * 2;
-			ViewRectSizeMinsOneParameter = ParentTextureSrcSize - FIntPoint(1, 1);
-		}
-
-		SetShaderValue(RHICmdList, RHICmdList.GetBoundComputeShader(), ViewRectSizeMinsOne, ViewRectSizeMinsOneParameter);
-		SetShaderValue(RHICmdList, RHICmdList.GetBoundComputeShader(), ParentTextureInvSize, FVector2D(1.f / ParentTextureSrcSize.X, 1.f / ParentTextureSrcSize.Y));
-		SetShaderValue(RHICmdList, RHICmdList.GetBoundComputeShader(), FirstDownSampleBuild, FirstDownSampleBuildParameter);
+		return FMobileHzbSystem::ShouldCompileTextureShaders(Parameters) && ShouldCompileHzbWaveOpsPermutation<FWaveOps, FPermutationDomain>(Parameters);
 	}
 
-	void UnBindParameters(FRHICommandList& RHICmdList) {
-		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), FurthestMipOutput_0, nullptr);
-		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), FurthestMipOutput_1, nullptr);
-		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), FurthestMipOutput_2, nullptr);
-		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), FurthestMipOutput_3, nullptr);
+	static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment) {
+		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+		FMobileHzbSystem::ModifyHzbCompilationEnvironment(OutEnvironment);
+		ModifyHzbWaveOpsCompilationEnvironment<FWaveOps, FPermutationDomain>(Parameters, OutEnvironment);
 	}
-
-private:
-	LAYOUT_FIELD(FShaderResourceParameter, ParentTextureMip);
-	LAYOUT_FIELD(FShaderResourceParameter, ParentTextureMipSampler);
-	LAYOUT_FIELD(FShaderParameter, ParentTextureInvSize);
-	LAYOUT_FIELD(FShaderParameter, ViewRectSizeMinsOne);
-	LAYOUT_FIELD(FShaderParameter, FirstDownSampleBuild);
-	LAYOUT_FIELD(FShaderResourceParameter, FurthestMipOutput_0);
-	LAYOUT_FIELD(FShaderResourceParameter, FurthestMipOutput_1);
-	LAYOUT_FIELD(FShaderResourceParameter, FurthestMipOutput_2);
-	LAYOUT_FIELD(FShaderResourceParameter, FurthestMipOutput_3);
 };
 
 IMPLEMENT_GLOBAL_SHADER(FMobileHZBBuildPS, "/Engine/Private/MobileHZB.usf", "HZBBuildPS", SF_Pixel);
 IMPLEMENT_GLOBAL_SHADER(FMobileTextureBuildCS, "/Engine/Private/MobileHZB.usf", "HZBBuildCS", SF_Compute);
 IMPLEMENT_GLOBAL_SHADER(FMobileHZBBuildCSLevel0, "/Engine/Private/MobileBufferHZB.usf", "HZBBuildCSLevelZero", SF_Compute);
 IMPLEMENT_GLOBAL_SHADER(FMobileHZBBuildCSLevel1, "/Engine/Private/MobileBufferHZB.usf", "HZBBuildCSLevelOne", SF_Compute);
+IMPLEMENT_GLOBAL_SHADER(FMobileHZBBuildCSSinglePass, "/Engine/Private/MobileBufferHZB.usf", "HZBBuildCSSinglePass", SF_Compute);
 
-void FMobileHzbSystem::MobileComputeBuildHZB(FRHICommandListImmediate& RHICmdList, const FViewInfo& View) {
-	const FSceneRenderTargets& SceneContext = FSceneRenderTargets::Get(RHICmdList);
-	TRefCountPtr<IPooledRenderTarget> SceneTexture = nullptr;
-	if (CVarMobileUseSceneDepth.GetValueOnAnyThread() != 0) {
-		SceneTexture = SceneContext.SceneDepthZ;
-		RHICmdList.Transition(FRHITransitionInfo(SceneTexture->GetRenderTargetItem().ShaderResourceTexture, ERHIAccess::RTV, ERHIAccess::SRVCompute));
-	}
-	else {
-		SceneTexture = SceneContext.GetSceneColor();
-		RHICmdList.Transition(FRHITransitionInfo(MobileHZBTexture->GetRenderTargetItem().ShaderResourceTexture, ERHIAccess::DSVWrite, ERHIAccess::SRVCompute));
+void FMobileHzbSystem::AddComputeBuildHZBPasses(FRDGBuilder& GraphBuilder, const FViewInfo& View, FRDGTextureRef SceneTexture) {
+	FIntRect DirtyRect(FIntPoint::ZeroValue, BufferLayout.HzbSize);
+	if (ConsumeTemporalUpdate(View, DirtyRect) == EMobileHzbTemporalUpdate::Skip) {
+		return;
 	}
 
 	//TextureBuild
 	if(FMobileHzbSystem::bUseTextureResources) {
-		const int32 NumMipBatch = FMath::DivideAndRoundUp(NumMips, FMobileHzbSystem::ComputeShaderBuildBatch);;
+		RDG_GPU_STAT_SCOPE(GraphBuilder, MobileHZBBuild);
+		//Per mip SRV/UAV transitions come from the pass parameters
+		FRDGTextureRef RDGFurthestHZBTexture = GraphBuilder.RegisterExternalTexture(MobileHZBTexture, TEXT("MobileHZBFurthest"));
+		const ERDGPassFlags PassFlags = GetHzbBuildPassFlags();
+		const int32 NumMipBatch = FMath::DivideAndRoundUp(NumMips, FMobileHzbSystem::ComputeShaderBuildBatch);
 		FMobileTextureBuildCS::FPermutationDomain PermutationVector;
+		PermutationVector.Set<FMobileTextureBuildCS::FWaveOps>(UseHzbWaveOps(View.GetShaderPlatform()));
 		for (int32 LevelBatch = 0; LevelBatch < NumMipBatch; ++LevelBatch) {
 			int32 CurrentStartMipLevel = LevelBatch * FMobileHzbSystem::ComputeShaderBuildBatch;
 			int32 CurrentBatchMipLevelCount = FMath::Min(FMobileHzbSystem::ComputeShaderBuildBatch, NumMips - CurrentStartMipLevel);
 			const FIntPoint CurrentStartHzbTextureSize = FIntPoint(HzbSize.X >> CurrentStartMipLevel, HzbSize.Y >> CurrentStartMipLevel);
 			const int32 DispatchX = FMath::DivideAndRoundUp(CurrentStartHzbTextureSize.X, FMobileHzbSystem::GroupTileSize);
 			const int32 DispatchY = FMath::DivideAndRoundUp(CurrentStartHzbTextureSize.Y, FMobileHzbSystem::GroupTileSize);
+
+			FMobileTextureBuildCS::FParameters* PassParameters = GraphBuilder.AllocParameters<FMobileTextureBuildCS::FParameters>();
+			FIntPoint ParentTextureSrcSize;
+			PassParameters->FirstDownSampleBuild = 0;
+			if (CurrentStartMipLevel == 0) {
+				PassParameters->Shared.ParentTextureMip = GraphBuilder.CreateSRV(FRDGTextureSRVDesc::CreateForMipLevel(SceneTexture, 0));
+				if (!FMobileHzbSystem::bUseFullResolution) {
+					ParentTextureSrcSize = CurrentStartHzbTextureSize;
+					PassParameters->FirstDownSampleBuild = 1;
+					PassParameters->Shared.ViewRectSizeMinsOne = FIntPoint::ZeroValue;
+				}
+				else {
+					ParentTextureSrcSize = SceneTexture->Desc.Extent;
+					PassParameters->Shared.ViewRectSizeMinsOne = View.ViewRect.Size() - FIntPoint(1, 1);
+				}
+			}
+			else {
+				PassParameters->Shared.ParentTextureMip = GraphBuilder.CreateSRV(FRDGTextureSRVDesc::CreateForMipLevel(RDGFurthestHZBTexture, CurrentStartMipLevel - 1));
+				ParentTextureSrcSize = CurrentStartHzbTextureSize * 2;
+				PassParameters->Shared.ViewRectSizeMinsOne = ParentTextureSrcSize - FIntPoint(1, 1);
+			}
+			PassParameters->Shared.ParentTextureInvSize = FVector2D(1.f / ParentTextureSrcSize.X, 1.f / ParentTextureSrcSize.Y);
+			PassParameters->Shared.ParentTextureMipSampler = TStaticSamplerState<SF_Point, AM_Clamp, AM_Clamp, AM_Clamp>::GetRHI();
+			for (int32 Index = 0; Index < CurrentBatchMipLevelCount; ++Index) {
+				PassParameters->FurthestMipOutput[Index] = GraphBuilder.CreateUAV(FRDGTextureUAVDesc(RDGFurthestHZBTexture, CurrentStartMipLevel + Index));
+			}
+
 			PermutationVector.Set<FMobileTextureBuildCS::FDimMipLevelCount>(CurrentBatchMipLevelCount);
 			TShaderMapRef<FMobileTextureBuildCS> HzbGeneratorShader(View.ShaderMap, PermutationVector);
-			RHICmdList.SetComputeShader(HzbGeneratorShader.GetComputeShader());
-			HzbGeneratorShader->BindParameters(
-				RHICmdList, 
-				View, 
-				CurrentStartHzbTextureSize, 
-				SceneTexture, 
-				CurrentStartMipLevel > 0 ? MipSRVs[CurrentStartMipLevel - 1] : nullptr, 
-				MipUAVs, 
-				CurrentStartMipLevel, 
-				CurrentBatchMipLevelCount);
-			RHICmdList.DispatchComputeShader(DispatchX, DispatchY, 1);
-			HzbGeneratorShader->UnBindParameters(RHICmdList);
+			FComputeShaderUtils::AddPass(
+				GraphBuilder,
+				RDG_EVENT_NAME("MobileBuildHZB(mip=%d-%d) %dx%d", CurrentStartMipLevel, CurrentStartMipLevel + CurrentBatchMipLevelCount - 1, CurrentStartHzbTextureSize.X, CurrentStartHzbTextureSize.Y),
+				PassFlags,
+				HzbGeneratorShader,
+				PassParameters,
+				FIntVector(DispatchX, DispatchY, 1));
 		}
-		//PerMip transition?
-		RHICmdList.Transition(FRHITransitionInfo(MobileHZBTexture->GetRenderTargetItem().ShaderResourceTexture, ERHIAccess::UAVCompute, ERHIAccess::SRVCompute));
+		//Texture consumers outside the graph sample it as SRV
+		GraphBuilder.QueueTextureExtraction(RDGFurthestHZBTexture, &MobileHZBTexture, ERHIAccess::SRVCompute);
 	}
 	else {
-		//Level0
+		FMobileHzbBuildViews BuildViews;
+		BuildViews.Add(BufferBaseOffset, GetParentUVScaleBias(View, SceneTexture->Desc.Extent, BufferLayout.HzbSize));
+		AddBufferBuildPasses(GraphBuilder, View.ShaderMap, View.GetShaderPlatform(), SceneTexture, BuildViews, DirtyRect);
+	}
+}
+
+void FMobileHzbSystem::AddBufferBuildPasses(FRDGBuilder& GraphBuilder, FGlobalShaderMap* ShaderMap, const EShaderPlatform ShaderPlatform, FRDGTextureRef SceneTexture, const FMobileHzbBuildViews& BuildViews, const FIntRect& DirtyRect) {
+	FRDGBufferRef HzbBuffer = GraphBuilder.RegisterExternalBuffer(MobileHZBPooledBuffer, TEXT("MobileHZBBuffer"));
+	const ERDGPassFlags PassFlags = GetHzbBuildPassFlags();
+	const bool bUseSceneDepth = bLightViewHzb || CVarMobileUseSceneDepth.GetValueOnRenderThread() == 1;
+	//The last group of the single pass build needs every tile of mip 3
+	const bool bPartial = DirtyRect != FIntRect(FIntPoint::ZeroValue, BufferLayout.HzbSize);
+
+	if (CVarMobileHZBBufferBuildMode.GetValueOnRenderThread() == 1 && !bPartial) {
+		RDG_GPU_STAT_SCOPE(GraphBuilder, MobileHZBBuild);
+		//Transient counters, cleared every build instead of trusting the reset of the last group of a previous frame
+		FRDGBufferRef AtomicCounter = GraphBuilder.CreateBuffer(FRDGBufferDesc::CreateBufferDesc(sizeof(uint32), FMobileHzbBuildViews::kMaxViews), TEXT("MobileHZBAtomicCounter"));
+		FRDGBufferUAVRef AtomicCounterUAV = GraphBuilder.CreateUAV(AtomicCounter, PF_R32_UINT);
+		AddClearUAVPass(GraphBuilder, AtomicCounterUAV, 0);
+
+		//SinglePass, mip 0-3 per group, the last group alive of every view finishes its chain
+		const int32 DispatchX = FMath::DivideAndRoundUp(BufferLayout.HzbSize.X, GroupSizeX);
+		const int32 DispatchY = FMath::DivideAndRoundUp(BufferLayout.HzbSize.Y, GroupSizeY);
+		FMobileHZBBuildCSSinglePass::FParameters* PassParameters = GraphBuilder.AllocParameters<FMobileHZBBuildCSSinglePass::FParameters>();
+		SetHzbBufferLayoutParameters(PassParameters->Layout, BufferLayout, BuildViews);
+		SetHzbSceneTextureParameters(PassParameters->SceneTexture, SceneTexture, BuildViews, bLightViewHzb);
+		PassParameters->NumGroups = DispatchX * DispatchY;
+		PassParameters->HzbStructuredBufferUAV_Zero = GraphBuilder.CreateUAV(HzbBuffer);
+		PassParameters->HzbAtomicCounterUAV = AtomicCounterUAV;
+
+		FMobileHZBBuildCSSinglePass::FPermutationDomain PermutationVector;
+		PermutationVector.Set<FMobileHZBBuildCSSinglePass::FUseSceneDepth>(bUseSceneDepth);
+		PermutationVector.Set<FMobileHZBBuildCSSinglePass::FMinMax>(BufferLayout.HasClosestPlane());
+		PermutationVector.Set<FMobileHZBBuildCSSinglePass::FPackedFP16>(BufferLayout.bPackedFP16);
+		PermutationVector.Set<FMobileHZBBuildCSSinglePass::FTiled>(BufferLayout.bTiled);
+		PermutationVector.Set<FMobileHZBBuildCSSinglePass::FWaveOps>(UseHzbWaveOps(ShaderPlatform));
+		TShaderMapRef<FMobileHZBBuildCSSinglePass> HzbGeneratorShader(ShaderMap, PermutationVector);
+		FComputeShaderUtils::AddPass(
+			GraphBuilder,
+			RDG_EVENT_NAME("MobileBuildHZBSinglePass %dx%d", BufferLayout.HzbSize.X, BufferLayout.HzbSize.Y),
+			PassFlags,
+			HzbGeneratorShader,
+			PassParameters,
+			FIntVector(DispatchX, DispatchY, BuildViews.NumViews));
+	}
+	else {
+		//Level0, HzbSize and DirtyRect are multiples of the group tile
 		{
-			constexpr auto DispatchX = FMobileHzbSystem::kHzbTexWidth / GroupSizeX;
-			constexpr auto DispatchY = FMobileHzbSystem::kHzbTexHeight / GroupSizeY;
+			RDG_GPU_STAT_SCOPE(GraphBuilder, MobileHZBBuild);
+			const int32 DispatchX = DirtyRect.Width() / GroupTileSize;
+			const int32 DispatchY = DirtyRect.Height() / GroupTileSize;
+			FMobileHZBBuildCSLevel0::FParameters* PassParameters = GraphBuilder.AllocParameters<FMobileHZBBuildCSLevel0::FParameters>();
+			SetHzbBufferLayoutParameters(PassParameters->Layout, BufferLayout, BuildViews);
+			SetHzbSceneTextureParameters(PassParameters->SceneTexture, SceneTexture, BuildViews, bLightViewHzb);
+			PassParameters->GroupOffset = DirtyRect.Min / GroupTileSize;
+			PassParameters->HzbStructuredBufferUAV_Zero = GraphBuilder.CreateUAV(HzbBuffer);
+
 			FMobileHZBBuildCSLevel0::FPermutationDomain PermutationVector;
-			PermutationVector.Set<FMobileHZBBuildCSLevel0::FUseSceneDepth>(CVarMobileUseSceneDepth.GetValueOnRenderThread() == 1);
-			TShaderMapRef<FMobileHZBBuildCSLevel0> HzbGeneratorShader(View.ShaderMap, PermutationVector);
-			RHICmdList.SetComputeShader(HzbGeneratorShader.GetComputeShader());
-			HzbGeneratorShader->BindParameters(RHICmdList, View, SceneTexture->GetRenderTargetItem().ShaderResourceTexture, FMobileHzbSystem::GetStructuredBufferRes());
-			RHICmdList.DispatchComputeShader(DispatchX, DispatchY, 1);
-			HzbGeneratorShader->UnBindParameters(RHICmdList);
+			PermutationVector.Set<FMobileHZBBuildCSLevel0::FUseSceneDepth>(bUseSceneDepth);
+			PermutationVector.Set<FMobileHZBBuildCSLevel0::FMinMax>(BufferLayout.HasClosestPlane());
+			PermutationVector.Set<FMobileHZBBuildCSLevel0::FPackedFP16>(BufferLayout.bPackedFP16);
+			PermutationVector.Set<FMobileHZBBuildCSLevel0::FTiled>(BufferLayout.bTiled);
+			PermutationVector.Set<FMobileHZBBuildCSLevel0::FWaveOps>(UseHzbWaveOps(ShaderPlatform));
+			TShaderMapRef<FMobileHZBBuildCSLevel0> HzbGeneratorShader(ShaderMap, PermutationVector);
+			FComputeShaderUtils::AddPass(
+				GraphBuilder,
+				RDG_EVENT_NAME("MobileBuildHZBLevelZero %dx%d", DirtyRect.Width(), DirtyRect.Height()),
+				PassFlags,
+				HzbGeneratorShader,
+				PassParameters,
+				FIntVector(DispatchX, DispatchY, BuildViews.NumViews));
 		}
 
-		//Level1
-		{
-			constexpr auto DispatchX = 2;
-			constexpr auto DispatchY = 1;
-			TShaderMapRef<FMobileHZBBuildCSLevel1> HzbGeneratorShader(View.ShaderMap);
-			RHICmdList.SetComputeShader(HzbGeneratorShader.GetComputeShader());
-			HzbGeneratorShader->BindParameters(RHICmdList, View, FMobileHzbSystem::GetStructuredBufferRes());
-			RHICmdList.DispatchComputeShader(DispatchX, DispatchY, 1);
-			HzbGeneratorShader->UnBindParameters(RHICmdList);
+		//Level1, 4 mips per dispatch
+		AddReduceBufferMipsPasses(GraphBuilder, ShaderMap, ShaderPlatform, HzbBuffer, 4, BuildViews, DirtyRect);
+	}
+
+	//Only graphs writing the HZB hand it back, culling runs outside the graph and expects the buffer to rest in SRVCompute
+	GraphBuilder.QueueBufferExtraction(HzbBuffer, &MobileHZBPooledBuffer, ERHIAccess::SRVCompute);
+}
+
+void FMobileHzbSystem::AddReduceBufferMipsPasses(FRDGBuilder& GraphBuilder, FGlobalShaderMap* ShaderMap, const EShaderPlatform ShaderPlatform, FRDGBufferRef HzbBuffer, const int32 StartMipLevel, const FMobileHzbBuildViews& BuildViews, const FIntRect& DirtyRect) {
+	FMobileHZBBuildCSLevel1::FPermutationDomain PermutationVector;
+	PermutationVector.Set<FMobileHZBBuildCSLevel1::FMinMax>(BufferLayout.HasClosestPlane());
+	PermutationVector.Set<FMobileHZBBuildCSLevel1::FPackedFP16>(BufferLayout.bPackedFP16);
+	PermutationVector.Set<FMobileHZBBuildCSLevel1::FTiled>(BufferLayout.bTiled);
+	PermutationVector.Set<FMobileHZBBuildCSLevel1::FWaveOps>(UseHzbWaveOps(ShaderPlatform));
+	TShaderMapRef<FMobileHZBBuildCSLevel1> HzbGeneratorShader(ShaderMap, PermutationVector);
+	const ERDGPassFlags PassFlags = GetHzbBuildPassFlags();
+	RDG_GPU_STAT_SCOPE(GraphBuilder, MobileHZBReduceMips);
+	//Every pass reads the mips the previous one wrote, RDG keeps the UAV barrier between them
+	FRDGBufferUAVRef HzbBufferUAV = GraphBuilder.CreateUAV(HzbBuffer);
+	for (int32 MipLevel = StartMipLevel; MipLevel < BufferLayout.NumMips; MipLevel += FMobileHzbSystem::ComputeShaderBuildBatch) {
+		//Ancestors of the dirty mip 0 texels, a group owns the same 8x8 tile of the 4 mips it writes
+		const FIntPoint MipSize = BufferLayout.GetMipSize(MipLevel);
+		const FIntPoint MipGroups = FIntPoint::DivideAndRoundUp(MipSize, GroupTileSize);
+		const FIntPoint GroupMin = FIntPoint(DirtyRect.Min.X >> MipLevel, DirtyRect.Min.Y >> MipLevel) / GroupTileSize;
+		const FIntPoint GroupMax = FIntPoint::DivideAndRoundUp(FIntPoint::DivideAndRoundUp(DirtyRect.Max, 1 << MipLevel), GroupTileSize).ComponentMin(MipGroups);
+		FMobileHZBBuildCSLevel1::FParameters* PassParameters = GraphBuilder.AllocParameters<FMobileHZBBuildCSLevel1::FParameters>();
+		SetHzbBufferLayoutParameters(PassParameters->Layout, BufferLayout, BuildViews);
+		PassParameters->StartMipLevel = MipLevel;
+		PassParameters->GroupOffset = GroupMin;
+		PassParameters->HzbStructuredBufferUAV_One = HzbBufferUAV;
+		FComputeShaderUtils::AddPass(
+			GraphBuilder,
+			RDG_EVENT_NAME("MobileBuildHZBLevelOne(mip=%d) %dx%d", MipLevel, MipSize.X, MipSize.Y),
+			PassFlags,
+			HzbGeneratorShader,
+			PassParameters,
+			FIntVector(GroupMax.X - GroupMin.X, GroupMax.Y - GroupMin.Y, BuildViews.NumViews));
+	}
+}
+
+void FMobileHzbSystem::InitBatchedGPUResources(TArrayView<FMobileHzbSystem* const> Systems, const FMobileHzbBufferLayout& Layout) {
+	//Already sharing one buffer in this order
+	FMobileHzbSystem* FirstSystem = Systems[0];
+	bool bShared = FirstSystem->MobileHZBPooledBuffer.IsValid()
+		&& FirstSystem->MobileHZBPooledBuffer->Desc.GetTotalNumBytes() >= Systems.Num() * Layout.GetGPUElementCount() * sizeof(float);
+	for (int32 ViewIndex = 0; ViewIndex < Systems.Num() && bShared; ++ViewIndex) {
+		const FMobileHzbSystem* System = Systems[ViewIndex];
+		bShared = System->MobileHZBPooledBuffer == FirstSystem->MobileHZBPooledBuffer
+			&& System->BufferBaseOffset == ViewIndex * Layout.GetTotalElements()
+			&& System->BufferLayout == Layout;
+	}
+	if (bShared) {
+		return;
+	}
+
+	//Every system owns the shared buffer once, the pool reclaims it when the last view releases it
+	FShaderResourceViewRHIRef SharedSRV;
+	const TRefCountPtr<FRDGPooledBuffer> SharedPooledBuffer = GMobileHzbBufferPool.Acquire(Systems.Num() * Layout.GetGPUElementCount(), GFrameNumberRenderThread, SharedSRV);
+	for (int32 ViewIndex = 0; ViewIndex < Systems.Num(); ++ViewIndex) {
+		FMobileHzbSystem* System = Systems[ViewIndex];
+		System->ReleaseHzbBuffer();
+		if (ViewIndex > 0) {
+			GMobileHzbBufferPool.AddOwner(SharedPooledBuffer);
+		}
+		System->MobileHZBPooledBuffer = SharedPooledBuffer;
+		System->MobileHZBBufferSRV = SharedSRV;
+		System->BufferBaseOffset = ViewIndex * Layout.GetTotalElements();
+		System->BufferLayout = Layout;
+		System->NumMips = Layout.NumMips;
+		System->HzbSize = Layout.HzbSize;
+		System->bHzbViewMatricesValid = false;
+	}
+}
+
+void FMobileHzbSystem::AddBuildHzbPasses(FRDGBuilder& GraphBuilder, TArrayView<const FViewInfo> Views, FRDGTextureRef SceneTexture) {
+	FMobileHzbSystem::TickResourcePool(GFrameNumberRenderThread);
+	RDG_EVENT_SCOPE(GraphBuilder, "MobileHZB %d views", Views.Num());
+
+	//Views of one family share the scene depth, so one dispatch sequence covers all of them when their layouts match
+	bool bCanBatch = !FMobileHzbSystem::bUseTextureResources && CVarMobileHZBBatchViews.GetValueOnRenderThread() != 0
+		&& Views.Num() > 1 && Views.Num() <= FMobileHzbBuildViews::kMaxViews;
+	TArray<FMobileHzbSystemRef, TInlineAllocator<FMobileHzbBuildViews::kMaxViews>> SystemRefs;
+	TArray<FMobileHzbSystem*, TInlineAllocator<FMobileHzbBuildViews::kMaxViews>> Systems;
+	const FMobileHzbBufferLayout Layout = bCanBatch ? ComputeBufferLayout(Views[0]) : FMobileHzbBufferLayout();
+	for (int32 ViewIndex = 0; ViewIndex < Views.Num() && bCanBatch; ++ViewIndex) {
+		const FMobileHzbSystemRef FoundSystem = FMobileHzbSystem::GetHzbSystemByViewStateUniqueId(Views[ViewIndex].ViewState);
+		const FMobileHzbBufferLayout ViewLayout = ComputeBufferLayout(Views[ViewIndex]);
+		bCanBatch = FoundSystem && ViewLayout == Layout;
+		SystemRefs.Add(FoundSystem);
+		Systems.Add(FoundSystem.Get());
+	}
+
+	if (!bCanBatch) {
+		for (const FViewInfo& View : Views) {
+			const FMobileHzbSystemRef FoundSystem = FMobileHzbSystem::GetHzbSystemByViewStateUniqueId(View.ViewState);
+			if (FoundSystem) {
+				FoundSystem->LastRenderFrame = GFrameNumberRenderThread;
+				FoundSystem->AddComputeBuildHZBPasses(GraphBuilder, View, SceneTexture);
+				FoundSystem->HzbViewMatrices = View.ViewMatrices;
+				FoundSystem->bHzbViewMatricesValid = true;
+			}
+		}
+		return;
+	}
+
+	InitBatchedGPUResources(Systems, Layout);
+
+	//One dispatch sequence for all views, partial rebuilds of different rects become a full build
+	bool bSkipAll = true;
+	for (int32 ViewIndex = 0; ViewIndex < Views.Num(); ++ViewIndex) {
+		FIntRect DirtyRect;
+		bSkipAll &= Systems[ViewIndex]->ConsumeTemporalUpdate(Views[ViewIndex], DirtyRect) == EMobileHzbTemporalUpdate::Skip;
+	}
+
+	FMobileHzbBuildViews BuildViews;
+	for (int32 ViewIndex = 0; ViewIndex < Views.Num(); ++ViewIndex) {
+		BuildViews.Add(Systems[ViewIndex]->BufferBaseOffset, GetParentUVScaleBias(Views[ViewIndex], SceneTexture->Desc.Extent, Layout.HzbSize));
+	}
+	//All systems share the pooled buffer the first one registers and extracts
+	if (!bSkipAll) {
+		Systems[0]->AddBufferBuildPasses(GraphBuilder, Views[0].ShaderMap, Views[0].GetShaderPlatform(), SceneTexture, BuildViews, FIntRect(FIntPoint::ZeroValue, Layout.HzbSize));
+	}
+
+	for (int32 ViewIndex = 0; ViewIndex < Views.Num(); ++ViewIndex) {
+		FMobileHzbSystem* System = Systems[ViewIndex];
+		System->LastRenderFrame = GFrameNumberRenderThread;
+		System->HzbViewMatrices = Views[ViewIndex].ViewMatrices;
+		System->bHzbViewMatricesValid = true;
+	}
+}
+
+void FMobileHzbSystem::MobileBuildHzbBatched(FRDGBuilder& GraphBuilder, TArrayView<const FViewInfo> Views) {
+	FRHICommandListImmediate& RHICmdList = GraphBuilder.RHICmdList;
+#if !(UE_BUILD_SHIPPING || UE_BUILD_TEST)
+	if (CVarMobileBuildHZB.GetValueOnAnyThread() == 0) {
+		return;
+	}
+	RHICmdList.SetCurrentStat(GET_STATID(STAT_CLMM_HZBOcclusionGenerator));
+	//The raster build writes MobileHZBTexture, its shaders are only cooked with bUseTextureResources
+	const bool bUseRaster = CVarMobileUseRaster.GetValueOnAnyThread() != 0 && FMobileHzbSystem::bUseTextureResources;
+#else
+	const bool bUseRaster = FMobileHzbSystem::bUsePixelShader;
+#endif
+	//Publishes the counters of the previous frame before any query of this one
+	GMobileHzbStats.Tick(RHICmdList);
+
+	//Occluders handed over since the last build, r.GpuDriven.MobileHZB.CpuOccluders 2 uploads their HZB right away
+	for (const FViewInfo& View : Views) {
+		const FMobileHzbSystemRef FoundSystem = FMobileHzbSystem::GetHzbSystemByViewStateUniqueId(View.ViewState);
+		if (FoundSystem && FoundSystem->PendingOccluders.Num() > 0) {
+			MobileRasterizeOccluders(RHICmdList, View, MoveTemp(FoundSystem->PendingOccluders));
+			FoundSystem->PendingOccluders.Reset();
 		}
+	}
 
-		RHICmdList.Transition(FRHITransitionInfo(MobileHZBBuffer_GPU.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVCompute));
+	//r.GpuDriven.MobileHZB.CpuOccluders 2 already uploaded the HZB of every view this frame
+	bool bAllCpuUploaded = !bUseRaster;
+	for (const FViewInfo& View : Views) {
+		const FMobileHzbSystemRef FoundSystem = FMobileHzbSystem::GetHzbSystemByViewStateUniqueId(View.ViewState);
+		bAllCpuUploaded &= FoundSystem && FoundSystem->CpuOccluderUploadFrame == GFrameNumberRenderThread;
 	}
+
+	//The renderer registered the same scene texture, RDG hands back its tracked texture
+	FRDGTextureRef SceneTexture = RegisterHzbSceneTexture(GraphBuilder, RHICmdList);
+	if (bUseRaster) {
+		FMobileHzbSystem::TickResourcePool(GFrameNumberRenderThread);
+		for (const FViewInfo& View : Views) {
+			const FMobileHzbSystemRef FoundSystem = FMobileHzbSystem::GetHzbSystemByViewStateUniqueId(View.ViewState);
+			if (FoundSystem) {
+				FoundSystem->LastRenderFrame = GFrameNumberRenderThread;
+				FoundSystem->AddRasterBuildHZBPasses(GraphBuilder, View, SceneTexture);
+				FoundSystem->HzbViewMatrices = View.ViewMatrices;
+				FoundSystem->bHzbViewMatricesValid = true;
+			}
+		}
+	}
+	else if (!bAllCpuUploaded) {
+		AddBuildHzbPasses(GraphBuilder, Views, SceneTexture);
+	}
+
+	//Copies of the new HZB, ordered after the build by the graph
+	if (CVarMobileHZBReadbackDepth.GetValueOnRenderThread() > 0) {
+		for (const FViewInfo& View : Views) {
+			const FMobileHzbSystemRef FoundSystem = FMobileHzbSystem::GetHzbSystemByViewStateUniqueId(View.ViewState);
+			if (FoundSystem) {
+				FoundSystem->PollReadback();
+#if !(UE_BUILD_SHIPPING || UE_BUILD_TEST)
+				FoundSystem->ValidateLatestReadback();
+#endif
+				FoundSystem->AddReadbackPass(GraphBuilder, View);
+			}
+		}
+	}
+}
+
+const FViewMatrices& FMobileHzbSystem::GetHzbViewMatrices(const FViewInfo& View) const {
+	return bHzbViewMatricesValid ? HzbViewMatrices : View.ViewMatrices;
+}
+
+bool FMobileHzbSystem::IsHzbViewMoved(const FViewInfo& View) const {
+	return !GetHzbViewMatrices(View).GetViewProjectionMatrix().Equals(View.ViewMatrices.GetViewProjectionMatrix(), 0.f);
+}
+
+void FMobileHzbSystem::SetHZBLayoutForShader(FRHICommandList& RHICmdList, const FShaderParameter& MipLayoutParameter, const FShaderParameter& SizeParameter) const {
+	FUintVector4 MipLayout[FMobileHzbBufferLayout::kMaxMipCount];
+	BufferLayout.GetShaderMipLayout(MipLayout, BufferBaseOffset);
+	SetShaderValueArray(RHICmdList, RHICmdList.GetBoundComputeShader(), MipLayoutParameter, MipLayout, FMobileHzbBufferLayout::kMaxMipCount);
+	SetShaderValue(RHICmdList, RHICmdList.GetBoundComputeShader(), SizeParameter, FUintVector4(BufferLayout.HzbSize.X, BufferLayout.HzbSize.Y, BufferLayout.NumMips, 0));
 }
 
 void FMobileHzbSystem::SetHZBResourcesForShader(FRHICommandList& RHICmdList, const FShaderResourceParameter& TargetResource, const FShaderResourceParameter* TextureSamplerResource) {
@@ -396,42 +778,226 @@ void FMobileHzbSystem::SetHZBResourcesForShader(FRHICommandList& RHICmdList, con
 		);
 	}
 	else {
-		SetSRVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), TargetResource, MobileHZBBuffer_GPU.SRV);
+		SetSRVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), TargetResource, MobileHZBBufferSRV);
 	}
 }
 
+BEGIN_SHADER_PARAMETER_STRUCT(FMobileHzbReadbackTextureParameters, )
+	RDG_TEXTURE_ACCESS(HzbTexture, ERHIAccess::CopySrc)
+END_SHADER_PARAMETER_STRUCT()
+
+BEGIN_SHADER_PARAMETER_STRUCT(FMobileHzbReadbackBufferParameters, )
+	RDG_BUFFER_ACCESS(HzbBuffer, ERHIAccess::CopySrc)
+END_SHADER_PARAMETER_STRUCT()
+
+void FMobileHzbSystem::AddReadbackPass(FRDGBuilder& GraphBuilder, const FViewInfo& View) {
+	SCOPE_CYCLE_COUNTER(STAT_CLMM_HZBCopyOcclusionSubmit);
+
+	const int32 RingDepth = FMath::Clamp(CVarMobileHZBReadbackDepth.GetValueOnRenderThread(), 1, 8);
+	if (ReadbackRing.Num() != RingDepth) {
+		//Dropped slots only release their RHI references, nothing waits on them
+		ReadbackRing.Reset();
+		ReadbackRing.SetNum(RingDepth);
+		ReadbackWriteIndex = 0;
+	}
+
+	//Ring full, the oldest copy is still in flight. Skip this frame instead of stalling the render thread
+	FMobileHzbReadbackSlot& Slot = ReadbackRing[ReadbackWriteIndex];
+	if (Slot.bPending) {
+		return;
+	}
+
+	const int32 FirstMipLevel = FMath::Clamp(CVarMobileHZBReadbackFirstMip.GetValueOnRenderThread(), 0, BufferLayout.NumMips - 1);
+	if (!Slot.Fence.IsValid()) {
+		Slot.Fence = RHICreateGPUFence(TEXT("MobileHZBReadbackFence"));
+	}
+	Slot.Fence->Clear();
+
+	//The lambdas run when the graph executes, they keep their own references of the slot resources
+	const FGPUFenceRHIRef Fence = Slot.Fence;
+	if (FMobileHzbSystem::bUseTextureResources) {
+		if (Slot.FirstMipLevel != FirstMipLevel || Slot.StagingTextures.Num() != BufferLayout.NumMips - FirstMipLevel || Slot.Layout.HzbSize != BufferLayout.HzbSize) {
+			Slot.StagingTextures.Reset();
+			for (int32 MipLevel = FirstMipLevel; MipLevel < BufferLayout.NumMips; ++MipLevel) {
+				const FIntPoint MipSize = BufferLayout.GetMipSize(MipLevel);
+				FRHIResourceCreateInfo CreateInfo;
+				Slot.StagingTextures.Emplace(RHICreateTexture2D(MipSize.X, MipSize.Y, PF_R16F, 1, 1, TexCreate_CPUReadback, ERHIAccess::CopyDest, CreateInfo));
+			}
+		}
+
+		FMobileHzbReadbackTextureParameters* PassParameters = GraphBuilder.AllocParameters<FMobileHzbReadbackTextureParameters>();
+		PassParameters->HzbTexture = GraphBuilder.RegisterExternalTexture(MobileHZBTexture, TEXT("MobileHZBFurthest"));
+		GraphBuilder.AddPass(
+			RDG_EVENT_NAME("MobileHZBReadback(mip=%d-%d)", FirstMipLevel, BufferLayout.NumMips - 1),
+			PassParameters,
+			ERDGPassFlags::Readback,
+			[PassParameters, StagingTextures = Slot.StagingTextures, Fence, Layout = BufferLayout, FirstMipLevel](FRHICommandListImmediate& RHICmdList) {
+				for (int32 MipLevel = FirstMipLevel; MipLevel < Layout.NumMips; ++MipLevel) {
+					FRHICopyTextureInfo CopyInfo;
+					CopyInfo.Size = FIntVector(Layout.GetMipSize(MipLevel).X, Layout.GetMipSize(MipLevel).Y, 1);
+					CopyInfo.SourceMipIndex = MipLevel;
+					RHICmdList.CopyTexture(PassParameters->HzbTexture->GetRHI(), StagingTextures[MipLevel - FirstMipLevel], CopyInfo);
+				}
+				RHICmdList.WriteGPUFence(Fence);
+			});
+	}
+	else {
+		if (!Slot.StagingBuffer.IsValid()) {
+			Slot.StagingBuffer = RHICreateStagingBuffer();
+		}
+		const uint32 ElementBytes = BufferLayout.GetElementBytes();
+		const uint32 OffsetBytes = BufferBaseOffset * ElementBytes + BufferLayout.GetMipOffset(FirstMipLevel) * ElementBytes;
+		const uint32 NumBytes = (BufferLayout.NumElements - BufferLayout.GetMipOffset(FirstMipLevel)) * ElementBytes;
+		FMobileHzbReadbackBufferParameters* PassParameters = GraphBuilder.AllocParameters<FMobileHzbReadbackBufferParameters>();
+		PassParameters->HzbBuffer = GraphBuilder.RegisterExternalBuffer(MobileHZBPooledBuffer, TEXT("MobileHZBBuffer"));
+		GraphBuilder.AddPass(
+			RDG_EVENT_NAME("MobileHZBReadback(mip=%d-%d)", FirstMipLevel, BufferLayout.NumMips - 1),
+			PassParameters,
+			ERDGPassFlags::Readback,
+			[PassParameters, StagingBuffer = Slot.StagingBuffer, Fence, OffsetBytes, NumBytes](FRHICommandListImmediate& RHICmdList) {
+				RHICmdList.CopyToStagingBuffer(PassParameters->HzbBuffer->GetRHIStructuredBuffer(), StagingBuffer, OffsetBytes, NumBytes);
+				RHICmdList.WriteGPUFence(Fence);
+			});
+	}
+
+	Slot.ViewMatrices = View.ViewMatrices;
+	Slot.Layout = BufferLayout;
+	Slot.FrameNumber = View.Family->FrameNumber;
+	Slot.FirstMipLevel = FirstMipLevel;
+	Slot.bPending = true;
+	ReadbackWriteIndex = (ReadbackWriteIndex + 1) % ReadbackRing.Num();
+}
+
+void FMobileHzbSystem::PollReadback() {
+	//Only the newest finished copy is published, older finished ones are simply recycled
+	FMobileHzbReadbackSlot* NewestSlot = nullptr;
+	for (FMobileHzbReadbackSlot& Slot : ReadbackRing) {
+		if (Slot.bPending && Slot.Fence->Poll()) {
+			if (!NewestSlot || Slot.FrameNumber > NewestSlot->FrameNumber) {
+				if (NewestSlot) {
+					NewestSlot->bPending = false;
+				}
+				NewestSlot = &Slot;
+			}
+			else {
+				Slot.bPending = false;
+			}
+		}
+	}
+
+	if (!NewestSlot || (LatestReadback.HzbBuffer.Num() > 0 && NewestSlot->FrameNumber <= LatestReadback.FrameNumber)) {
+		if (NewestSlot) {
+			NewestSlot->bPending = false;
+		}
+		return;
+	}
+
+	const FMobileHzbBufferLayout& Layout = NewestSlot->Layout;
+	LatestReadback.ViewMatrices = NewestSlot->ViewMatrices;
+	LatestReadback.FrameNumber = NewestSlot->FrameNumber;
+	LatestReadback.FirstMipLevel = NewestSlot->FirstMipLevel;
+	LatestReadback.Layout = Layout;
+	LatestReadback.HzbBuffer.Reset();
+	LatestReadback.HzbBuffer.SetNumZeroed(Layout.NumElements);
+
+	if (NewestSlot->StagingTextures.Num() > 0) {
+		for (int32 MipLevel = NewestSlot->FirstMipLevel; MipLevel < Layout.NumMips; ++MipLevel) {
+			void* MipData = nullptr;
+			int32 RowPitchInPixels = 0;
+			int32 MipHeight = 0;
+			FRHITexture* StagingTexture = NewestSlot->StagingTextures[MipLevel - NewestSlot->FirstMipLevel];
+			RHIMapStagingSurface(StagingTexture, NewestSlot->Fence, MipData, RowPitchInPixels, MipHeight);
+			const FIntPoint MipSize = Layout.GetMipSize(MipLevel);
+			for (int32 Y = 0; Y < MipSize.Y; ++Y) {
+				const FFloat16* SrcRow = static_cast<const FFloat16*>(MipData) + Y * RowPitchInPixels;
+				float* DstRow = LatestReadback.HzbBuffer.GetData() + Layout.GetElementIndex(MipLevel, 0, Y);
+				for (int32 X = 0; X < MipSize.X; ++X) {
+					DstRow[X] = SrcRow[X].GetFloat();
+				}
+			}
+			RHIUnmapStagingSurface(StagingTexture);
+		}
+	}
+	else {
+		const uint32 OffsetElements = Layout.GetMipOffset(NewestSlot->FirstMipLevel);
+		const uint32 NumBytes = (Layout.NumElements - OffsetElements) * Layout.GetElementBytes();
+		const void* Data = RHILockStagingBuffer(NewestSlot->StagingBuffer, NewestSlot->Fence, 0, NumBytes);
+		if (Layout.bPackedFP16) {
+			//Even texel in the low half of every uint, little endian makes it a plain FFloat16 array
+			const FFloat16* SrcData = static_cast<const FFloat16*>(Data);
+			float* DstData = LatestReadback.HzbBuffer.GetData() + OffsetElements;
+			for (uint32 Index = 0; Index < Layout.NumElements - OffsetElements; ++Index) {
+				DstData[Index] = SrcData[Index].GetFloat();
+			}
+		}
+		else {
+			FMemory::Memcpy(LatestReadback.HzbBuffer.GetData() + OffsetElements, Data, NumBytes);
+		}
+		RHIUnlockStagingBuffer(NewestSlot->StagingBuffer);
+	}
+	NewestSlot->bPending = false;
+}
+
 FMobileHzbSystem::FMobileHzbSystem() 
 	: NumMips(0)
 	, HzbSize(FIntPoint::ZeroValue)
+	, BufferBaseOffset(0)
+	, BufferLayout(GetDefaultBufferLayout())
+	, bHzbViewMatricesValid(false)
+	, ReadbackWriteIndex(0)
+	, ValidatedReadbackFrame(0)
+	, LastRenderFrame(0)
+	, bAllOccludersDirty(false)
+	, TemporalNumPrimitives(INDEX_NONE)
+	, LastFullBuildFrame(0)
+	, bTemporalHistoryValid(false)
+	, CpuOccluderUploadFrame(~0u)
+	, bLightViewHzb(false)
+	, LightViewWorldToClip(FMatrix::Identity)
 {
 	//不想每次创建就马上创建RHI资源,单独放在Render函数中
 }
 
 FMobileHzbSystem::~FMobileHzbSystem() {
-	MobileHZBBuffer_GPU.Release();
+	WaitCpuHzbTask();
+	ReleaseHzbBuffer();
+	InstanceVisibilityBits.Release();
 	MobileHZBTexture.SafeRelease(); //#TODO: GlobleRender Resources释放时机晚于SceneRenderTarget, 不能使用RT POOL管理, 直接释放
 }
 
 void FMobileHzbSystem::RegisterViewStateToSystem(const uint32 SceneViewStateUniqueID) {
-	check(!ViewUniqueId2HzbSystemMap.Contains(SceneViewStateUniqueID));
-	ViewUniqueId2HzbSystemMap.Emplace(SceneViewStateUniqueID, MakeUnique<FMobileHzbSystem>());
+	SystemRegistry.Register(SceneViewStateUniqueID);
 }
 
 void FMobileHzbSystem::UnRegisterViewStateToSystem(const uint32 SceneViewStateUniqueID) {
-	const uint32 NumRemove = ViewUniqueId2HzbSystemMap.Remove(SceneViewStateUniqueID);
-	check(NumRemove == 1);
+	SystemRegistry.Unregister(SceneViewStateUniqueID);
 }
 
-FMobileHzbSystem* FMobileHzbSystem::GetHzbSystemByViewStateUniqueId(const FSceneViewState* ViewStatePtr) {
+FMobileHzbSystemRef FMobileHzbSystem::GetHzbSystemByViewStateUniqueId(const FSceneViewState* ViewStatePtr) {
 	if (ViewStatePtr) {
-		const TUniquePtr<FMobileHzbSystem>& FoundSystem = ViewUniqueId2HzbSystemMap.FindChecked(ViewStatePtr->UniqueID);
-		check(FoundSystem.Get());
-		return FoundSystem.Get();
+		FMobileHzbSystemRef FoundSystem = SystemRegistry.Find(ViewStatePtr->UniqueID);
+		check(FoundSystem);
+		return FoundSystem;
 	}
 	return nullptr;
 }
 
-void FMobileHzbSystem::InitGPUResources(FViewInfo& View) {
+FMobileHzbBufferLayout FMobileHzbSystem::ComputeBufferLayout(const FViewInfo& View) {
+	const FIntPoint ViewSize = View.ViewRect.Size();
+	const int32 RequestedWidth = CVarMobileHZBResolution.GetValueOnRenderThread();
+	int32 Width = (bUseFullResolution || RequestedWidth <= 0) ? ViewSize.X / 2 : RequestedWidth;
+
+	//Multiple of the group tile so LevelZero writes full 8x8 tiles, at least 4 mips for LevelZero
+	Width = FMath::Clamp(Align(Width, GroupTileSize), kMinHzbSize, kMaxHzbSize);
+	int32 Height = FMath::DivideAndRoundUp(Width * FMath::Max(ViewSize.Y, 1), FMath::Max(ViewSize.X, 1));
+	Height = FMath::Clamp(Align(Height, GroupTileSize), GroupTileSize, kMaxHzbSize);
+
+	const int32 LayoutNumMips = FMath::Min<int32>(FMath::FloorLog2(FMath::Max(Width, Height)), FMobileHzbBufferLayout::kMaxMipCount);
+	return FMobileHzbBufferLayout(FIntPoint(Width, Height), LayoutNumMips, CVarMobileHZBMinMax.GetValueOnRenderThread() != 0, CVarMobileHZBFP16.GetValueOnRenderThread() != 0, CVarMobileHZBTiledLayout.GetValueOnRenderThread() != 0);
+}
+
+void FMobileHzbSystem::InitGPUResources(const FViewInfo& View) {
+	LastRenderFrame = GFrameNumberRenderThread;
 
 	if(FMobileHzbSystem::bUseTextureResources && HzbSize == FIntPoint::ZeroValue) {
 		FRHICommandListImmediate& RHICmdList = FRHICommandListExecutor::GetImmediateCommandList();
@@ -459,51 +1025,38 @@ void FMobileHzbSystem::InitGPUResources(FViewInfo& View) {
 		);
 
 		GRenderTargetPool.FindFreeElement(RHICmdList, MobileHZBFurthestDesc, MobileHZBTexture, TEXT("MobileHZBFurthest"), ERenderTargetTransience::NonTransient);
+		BufferLayout = FMobileHzbBufferLayout(HzbSize, NumMips);
 		
 		RHICmdList.Transition(FRHITransitionInfo(MobileHZBTexture->GetRenderTargetItem().ShaderResourceTexture, ERHIAccess::Unknown, ERHIAccess::SRVCompute));
-
-		MipSRVs.Reserve(NumMips);
-		MipUAVs.Reserve(NumMips);
-		for (int32 MipLevel = 0; MipLevel < NumMips; ++MipLevel) {
-			MipSRVs.Emplace(RHICreateShaderResourceView(MobileHZBTexture->GetRenderTargetItem().ShaderResourceTexture, MipLevel));
-			MipUAVs.Emplace(RHICreateUnorderedAccessView(MobileHZBTexture->GetRenderTargetItem().ShaderResourceTexture, MipLevel));
-		}
 		return;
 	}
 
 
-	if(!FMobileHzbSystem::bUseTextureResources && MobileHZBBuffer_GPU.NumBytes == 0){
-		constexpr int32 PerElementSize = sizeof(float);
-		constexpr int32 BufferElements = FMobileHzbSystem::kHzbTexWidth * FMobileHzbSystem::kHzbTexHeight * 2;
-		MobileHZBBuffer_GPU.Initialize(PerElementSize, BufferElements, BUF_Static);
+	if(!FMobileHzbSystem::bUseTextureResources) {
+		//Size follows the cvar and the ViewRect aspect ratio, reallocate only when it really changes
+		const FMobileHzbBufferLayout NewLayout = ComputeBufferLayout(View);
+		if (MobileHZBPooledBuffer.IsValid() && NewLayout == BufferLayout) {
+			return;
+		}
+
+		NumMips = NewLayout.NumMips;
+		HzbSize = NewLayout.HzbSize;
+		BufferLayout = NewLayout;
+		bHzbViewMatricesValid = false;
+		ReleaseHzbBuffer();
+		MobileHZBPooledBuffer = GMobileHzbBufferPool.Acquire(BufferLayout.GetGPUElementCount(), GFrameNumberRenderThread, MobileHZBBufferSRV);
 		return;
 	}
 }
 
 void FMobileHzbSystem::MobileBuildHzb(FRHICommandListImmediate& RHICmdList, const FViewInfo& View) {
-	//Hiz generator
 #if !(UE_BUILD_SHIPPING || UE_BUILD_TEST)
 	if (CVarMobileBuildHZB.GetValueOnAnyThread() == 0) {
 		return;
 	}
-	RHICmdList.SetCurrentStat(GET_STATID(STAT_CLMM_HZBOcclusionGenerator));
-#endif
-
-	FMobileHzbSystem* FoundSystem = FMobileHzbSystem::GetHzbSystemByViewStateUniqueId(View.ViewState);
-	if(FoundSystem) {
-		if (
-#if !(UE_BUILD_SHIPPING || UE_BUILD_TEST)
-			CVarMobileUseRaster.GetValueOnAnyThread() != 0
-#else
-			FMobileHzbSystem::bUsePixelShader
 #endif
-			)
-		{
-			FoundSystem->MobileRasterBuildHZB(RHICmdList, View);
-		}
-		else {
-			FoundSystem->MobileComputeBuildHZB(RHICmdList, View);
-		}
-	}
+	//Build passes only, the readback ring, its validation and the stats tick belong to the per frame build
+	FRDGBuilder GraphBuilder(RHICmdList);
+	AddBuildHzbPasses(GraphBuilder, MakeArrayView(&View, 1), RegisterHzbSceneTexture(GraphBuilder, RHICmdList));
+	GraphBuilder.Execute();
 }
-
@@ -2,11 +2,206 @@
 #include "CoreMinimal.h"
 #include "RenderGraph.h"
 #include "RHIUtilities.h"
+#include "RHIGPUReadback.h"
+#include "Async/TaskGraphInterfaces.h"
+#include "SceneView.h"
+#include "RenderResource.h"
+#include "Misc/ScopeRWLock.h"
 
 class FViewInfo;
-class FRDGBuilder; 
+class FRDGBuilder;
+struct FGlobalShaderPermutationParameters;
+class FGlobalShaderMap;
+struct FShaderCompilerEnvironment; 
 
-#define USE_LOW_RESLUTION 1
+DECLARE_STATS_GROUP(TEXT("MobileHZB"), STATGROUP_MobileHZB, STATCAT_Advanced);
+
+//Packed StorageBuffer layout written by HZBBuildCSLevelZero/HZBBuildCSLevelOne, every mip is stored right after the previous one
+//Row-major by default, bTiled stores every mip as row-major 4x4 tiles (64 bytes, one cache line) of row-major texels
+struct FMobileHzbBufferLayout {
+	static constexpr int32 kMaxMipCount = 12;
+	static constexpr int32 kTileSize = 4; //HZB_TILE_SIZE
+
+	FMobileHzbBufferLayout() : HzbSize(FIntPoint::ZeroValue), NumMips(0), NumElements(0), ClosestPlaneOffset(0), bPackedFP16(false), bTiled(false) {}
+	//bInMinMax appends a closest depth plane with the same mip layout right after the furthest chain
+	//bInPackedFP16 stores two texels per uint on the GPU, mip offsets are kept even so a pair never straddles two mips
+	//bInTiled pads every mip to whole tiles, GetElementIndex is the only valid way to address a texel
+	FMobileHzbBufferLayout(const FIntPoint InHzbSize, const int32 InNumMips, const bool bInMinMax = false, const bool bInPackedFP16 = false, const bool bInTiled = false);
+
+	bool operator==(const FMobileHzbBufferLayout& Other) const { return HzbSize == Other.HzbSize && NumMips == Other.NumMips && ClosestPlaneOffset == Other.ClosestPlaneOffset && bPackedFP16 == Other.bPackedFP16 && bTiled == Other.bTiled; }
+	bool operator!=(const FMobileHzbBufferLayout& Other) const { return !(*this == Other); }
+
+	uint32 GetMipOffset(const int32 MipLevel) const { return MipOffset[MipLevel]; }
+	FIntPoint GetMipSize(const int32 MipLevel) const { return MipSize[MipLevel]; }
+	uint32 GetElementIndex(const int32 MipLevel, const int32 X, const int32 Y) const {
+		if (bTiled) {
+			//Same as GetHZBBufferIndex of MobileHZB.ush with HZB_TILED
+			const uint32 TilePitch = FMath::DivideAndRoundUp(MipSize[MipLevel].X, kTileSize);
+			const uint32 TileIndex = (Y / kTileSize) * TilePitch + X / kTileSize;
+			return MipOffset[MipLevel] + TileIndex * (kTileSize * kTileSize) + (Y % kTileSize) * kTileSize + X % kTileSize;
+		}
+		return MipOffset[MipLevel] + Y * MipSize[MipLevel].X + X;
+	}
+	bool HasClosestPlane() const { return ClosestPlaneOffset != 0; }
+	//Furthest chain plus the closest plane, what the GPU buffer of one view holds
+	uint32 GetTotalElements() const { return NumElements + ClosestPlaneOffset; }
+	//GPU bytes of one texel, offsets and sizes of the GPU buffer stay in texels
+	uint32 GetElementBytes() const { return bPackedFP16 ? sizeof(FFloat16) : sizeof(float); }
+	//Structured buffer elements (4 bytes) of one view
+	uint32 GetGPUElementCount() const { return GetTotalElements() * GetElementBytes() / sizeof(float); }
+	//HzbMipLayout[HZB_MAX_MIP_COUNT] shader table, x: offset, y: pitch(width), z: height, w: closest plane distance. BaseOffset places the chain inside a shared multi view buffer
+	void GetShaderMipLayout(FUintVector4* OutMipLayout, const uint32 BaseOffset = 0) const {
+		for (int32 MipLevel = 0; MipLevel < kMaxMipCount; ++MipLevel) {
+			OutMipLayout[MipLevel] = FUintVector4(BaseOffset + MipOffset[MipLevel], MipSize[MipLevel].X, MipSize[MipLevel].Y, ClosestPlaneOffset);
+		}
+	}
+
+	FIntPoint HzbSize;
+	int32 NumMips;
+	uint32 NumElements; //Furthest chain only, CPU build and readback never touch the closest plane
+	uint32 ClosestPlaneOffset; //0 without closest plane, NumElements otherwise
+	bool bPackedFP16;
+	bool bTiled;
+	uint32 MipOffset[kMaxMipCount];
+	FIntPoint MipSize[kMaxMipCount];
+};
+
+//NDC rects and closest device Z of the tested bounds, SoA so the query can run 4 bounds per SIMD lane
+struct FMobileHzbQueryBatch {
+	TArrayView<const float> NDCMinX;
+	TArrayView<const float> NDCMinY;
+	TArrayView<const float> NDCMaxX;
+	TArrayView<const float> NDCMaxY;
+	TArrayView<const float> MaxZ;
+
+	int32 Num() const { return MaxZ.Num(); }
+};
+
+//Newest HZB copied back to the CPU, mips below FirstMipLevel are not read back and stay 0 (furthest) so queries hitting them keep the bounds visible
+struct FMobileHzbReadbackResult {
+	FViewMatrices ViewMatrices;
+	uint32 FrameNumber = 0;
+	int32 FirstMipLevel = 0;
+	FMobileHzbBufferLayout Layout;
+	TArray<float> HzbBuffer;
+};
+
+struct FMobileHzbReadbackSlot {
+	FStagingBufferRHIRef StagingBuffer;
+	TArray<FTextureRHIRef> StagingTextures; //Texture path, one per read back mip
+	FGPUFenceRHIRef Fence;
+	FViewMatrices ViewMatrices;
+	FMobileHzbBufferLayout Layout;
+	uint32 FrameNumber = 0;
+	int32 FirstMipLevel = 0;
+	bool bPending = false;
+};
+
+//Views reduced by one batched StorageBuffer build, SV_GroupID.z indexes them
+struct FMobileHzbBuildViews {
+	static constexpr int32 kMaxViews = 4; //HZB_MAX_VIEW_COUNT
+
+	FMobileHzbBuildViews() : NumViews(0) {
+		for (int32 ViewIndex = 0; ViewIndex < kMaxViews; ++ViewIndex) {
+			BaseOffset[ViewIndex] = FUintVector4(0, 0, 0, 0);
+			ParentUVScaleBias[ViewIndex] = FVector4(0.f, 0.f, 0.f, 0.f);
+		}
+	}
+
+	void Add(const uint32 InBaseOffset, const FVector4& InParentUVScaleBias) {
+		check(NumViews < kMaxViews);
+		BaseOffset[NumViews] = FUintVector4(InBaseOffset, 0, 0, 0);
+		ParentUVScaleBias[NumViews] = InParentUVScaleBias;
+		++NumViews;
+	}
+
+	int32 NumViews;
+	FUintVector4 BaseOffset[kMaxViews];
+	FVector4 ParentUVScaleBias[kMaxViews];
+};
+
+//GPU instance culling input, mirrors FInstanceBounds of MobileHZBInstanceCulling.usf
+struct FMobileHzbInstanceBounds {
+	enum EFlags : uint32 {
+		AlwaysVisible = 1u,
+	};
+
+	FVector Center;
+	uint32 BatchIndex;
+	FVector Extent;
+	uint32 Flags;
+};
+
+//One DrawIndexedIndirect per batch, InstanceOffset is the first slot of the batch in the compacted instance id buffer
+struct FMobileHzbDrawBatch {
+	uint32 IndexCount;
+	uint32 FirstIndex;
+	int32 BaseVertex;
+	uint32 InstanceOffset;
+};
+
+//DrawIndirectArgs holds 5 uints per batch, the vertex factory fetches CulledInstanceIds[StartInstanceLocation + InstanceId]
+struct FMobileHzbInstanceCullingResult {
+	static constexpr uint32 kDrawIndirectArgsStride = 5;
+
+	void Initialize(const uint32 NumBatches, const uint32 NumInstances);
+	void Release();
+	uint32 GetDrawArgsOffset(const uint32 BatchIndex) const { return BatchIndex * kDrawIndirectArgsStride * sizeof(uint32); }
+
+	FRWBuffer DrawIndirectArgs;
+	FRWBuffer CulledInstanceIds;
+};
+
+//Two phase culling: PreviousVisible -> draw -> MobileBuildHzb -> ReTest -> draw
+enum class EMobileHzbCullingPhase : uint8 {
+	Single,				//Test everything against the HZB already built
+	PreviousVisible,	//Instances visible last frame, frustum only
+	ReTest,				//Test everything against the fresh HZB, update the visibility bits, emit the newly visible ones only
+};
+
+//What a build does with the HZB of the previous frame, see r.GpuDriven.MobileHZB.TemporalReuse
+enum class EMobileHzbTemporalUpdate : uint8 {
+	Full,		//View changed, history invalid or too much is dirty
+	Partial,	//Rebuild the dirty mip 0 tiles and their ancestors
+	Skip,		//Same view and no dirty occluder, the previous HZB is still exact
+};
+
+//Low poly stand-in of a mesh the artists flagged as occluder, shared by every instance. Closed and fully inside the real mesh
+struct FMobileHzbOccluderMesh {
+	TArray<FVector> Vertices;
+	TArray<uint16> Indices; //Triangle list, either winding
+};
+
+//One occluder instance gathered by the scene for CPU rasterization
+struct FMobileHzbOccluder {
+	TSharedPtr<const FMobileHzbOccluderMesh, ESPMode::ThreadSafe> Mesh;
+	FMatrix LocalToWorld;
+	FBox WorldBounds;
+};
+
+//One cascade of the shadow depth the light view HZB is built from
+struct FMobileHzbShadowCascade {
+	FMatrix WorldToShadowClip; //Shadow depth = Z / W, standard Z with 0 at the light like the shadow depth passes write it
+	FIntRect AtlasRect; //Cascade texels of the shadow depth texture
+};
+
+//Query counters of r.GpuDriven.MobileHZB.Stats, must match HZB_STAT_* of MobileHZBInstanceCulling.usf
+namespace EMobileHzbStatCounter {
+	enum Type : uint32 {
+		Tested,				//Reached the frustum test, always visible instances are not counted
+		FrustumCulled,
+		OcclusionCulled,
+		ClosestAccepted,	//Min max HZB early accept, never reaches the furthest test
+		FirstMipLevel,		//One counter per mip the furthest test sampled
+		Num = FirstMipLevel + FMobileHzbBufferLayout::kMaxMipCount,
+	};
+}
+
+class FMobileHzbSystemRegistry;
+struct FMobileHzbSystem;
+
+//Keeps a system alive while it is used, Unregister may run while another thread still holds one. The last reference must drop on the render thread
+using FMobileHzbSystemRef = TSharedPtr<FMobileHzbSystem, ESPMode::ThreadSafe>;
 
 //ViewState to HzbSystem
 struct FMobileHzbSystem {
@@ -14,41 +209,154 @@ struct FMobileHzbSystem {
 	~FMobileHzbSystem();
 	
 	//Register Function
+	//Own graph executed right away, only for the mid frame rebuild of two phase culling. Compute build and extraction only,
+	//the readback and the stats stay with the per frame build that goes through MobileBuildHzbBatched
 	static void MobileBuildHzb(FRHICommandListImmediate& RHICmdList, const FViewInfo& View);
+	//All views of a family in one dispatch sequence, falls back to one build per view when they can't share a layout.
+	//Recorded into the renderer graph after the passes writing the scene depth, RDG schedules the build (async compute with r.GpuDriven.MobileHZB.AsyncCompute)
+	//and the readback copies against the passes after it. Culling outside the graph sees the HZB once the renderer executes it
+	static void MobileBuildHzbBatched(FRDGBuilder& GraphBuilder, TArrayView<const FViewInfo> Views);
+	//Compute build part of MobileBuildHzbBatched, without the raster build, the CPU occluder upload and the readback
+	static void AddBuildHzbPasses(FRDGBuilder& GraphBuilder, TArrayView<const FViewInfo> Views, FRDGTextureRef SceneTexture);
 	static void RegisterViewStateToSystem(const uint32 SceneViewStateUniqueID);
 	static void UnRegisterViewStateToSystem(const uint32 SceneViewStateUniqueID);
+	//Before culling, moves last frame StorageBuffer HZB to the current camera. Recorded into the renderer graph like the build
+	static void MobileReprojectHzb(FRDGBuilder& GraphBuilder, const FViewInfo& View);
+	//Render thread, for occluders added, removed or changed in place. Pass the bounds before and after, an invalid box dirties the whole screen of every view.
+	//Meant for the scene primitive add, remove and transform update paths. Until they call it temporal reuse drops the history when the primitive count changes
+	static void MarkOccludersDirty(const FBox& WorldBounds);
 
-	static FMobileHzbSystem* GetHzbSystemByViewStateUniqueId(const FSceneViewState* ViewStatePtr);
-	void InitGPUResources(FViewInfo& View);
+	static FMobileHzbSystemRef GetHzbSystemByViewStateUniqueId(const FSceneViewState* ViewStatePtr);
+	//Views idle for r.GpuDriven.MobileHZB.PoolReleaseFrames give their storage back, then the pool frees it after the same delay
+	static void TickResourcePool(const uint32 FrameNumber);
+	void ReleaseIdleResources();
+	//Gives MobileHZBPooledBuffer back to GMobileHzbBufferPool, the only way a system drops its storage
+	void ReleaseHzbBuffer();
+	void InitGPUResources(const FViewInfo& View);
 	void ReduceMips(FRDGTextureSRVRef RDGTexutreMip, FRDGTextureRef RDGFurthestHZBTexture, const FViewInfo& View, FRDGBuilder& GraphBuilder, uint32 CurOutHzbMipLevel);
-	void MobileRasterBuildHZB(FRHICommandListImmediate& RHICmdList, const FViewInfo& View);
-	void MobileComputeBuildHZB(FRHICommandListImmediate& RHICmdList, const FViewInfo& View);
+	void AddRasterBuildHZBPasses(FRDGBuilder& GraphBuilder, const FViewInfo& View, FRDGTextureRef SceneTexture);
+	void AddComputeBuildHZBPasses(FRDGBuilder& GraphBuilder, const FViewInfo& View, FRDGTextureRef SceneTexture);
+	//DirtyRect in mip 0 texels, aligned to GroupTileSize. Anything smaller than the whole HZB rebuilds those tiles with the two pass build.
+	//No view, the GPU build path test runs it on a synthetic depth texture
+	void AddBufferBuildPasses(FRDGBuilder& GraphBuilder, FGlobalShaderMap* ShaderMap, const EShaderPlatform ShaderPlatform, FRDGTextureRef SceneTexture, const FMobileHzbBuildViews& BuildViews, const FIntRect& DirtyRect);
+	void AddReduceBufferMipsPasses(FRDGBuilder& GraphBuilder, FGlobalShaderMap* ShaderMap, const EShaderPlatform ShaderPlatform, FRDGBufferRef HzbBuffer, const int32 StartMipLevel, const FMobileHzbBuildViews& BuildViews, const FIntRect& DirtyRect);
+	//Consumes the dirty occluders of this view, OutDirtyRect is only written for Partial
+	EMobileHzbTemporalUpdate ConsumeTemporalUpdate(const FViewInfo& View, FIntRect& OutDirtyRect);
+	static void InitBatchedGPUResources(TArrayView<FMobileHzbSystem* const> Systems, const FMobileHzbBufferLayout& Layout);
+	void AddReprojectBufferHZBPasses(FRDGBuilder& GraphBuilder, const FViewInfo& View);
 	void SetHZBResourcesForShader(FRHICommandList& RHICmdList, const FShaderResourceParameter& TargetResource, const FShaderResourceParameter* TextureSamplerResource = nullptr);
-	const FRWBufferStructured& GetStructuredBufferRes() const { return MobileHZBBuffer_GPU; }
+	//HZBMipLayout/HZBSize of the runtime sized IsVisibleHZBStorageBufferDownSampleUnreal4
+	void SetHZBLayoutForShader(FRHICommandList& RHICmdList, const FShaderParameter& MipLayoutParameter, const FShaderParameter& SizeParameter) const;
+	static FMobileHzbBufferLayout ComputeBufferLayout(const FViewInfo& View);
+	FRHIShaderResourceView* GetHzbBufferSRV() const { return MobileHZBBufferSRV; }
 	const FTextureRHIRef GetTextureRes() const { return MobileHZBTexture->GetRenderTargetItem().ShaderResourceTexture; }
 
+	//CPU Build, bit-exact twin of the StorageBuffer build, safe to run on any thread
+	static const FMobileHzbBufferLayout& GetDefaultBufferLayout();
+	static void MobileCpuBuildHZB(const FMobileHzbBufferLayout& Layout, const float* SceneDepth, const FIntPoint SceneDepthSize, float* OutHzbBuffer);
+	static void MobileCpuReduceMips(const FMobileHzbBufferLayout& Layout, float* InOutHzbBuffer, const int32 StartMipLevel);
+	//Texels of the mips above FirstMipLevel that differ from MobileCpuReduceMips of FirstMipLevel. Min commutes with the FP16 rounding, so exact for every GPU path
+	static int32 CountReduceMismatches(const FMobileHzbBufferLayout& Layout, const float* HzbBuffer, const int32 FirstMipLevel);
+	//SceneDepth is moved into the task, wait the returned event before touching MobileHZBBuffer_CPU
+	FGraphEventRef MobileCpuBuildHZBAsync(TArray<float>&& SceneDepth, const FIntPoint SceneDepthSize);
+	//Blocks until the last task writing MobileHZBBuffer_CPU is done
+	void WaitCpuHzbTask();
+
+	//CPU occluder rasterizer, same frame HZB without waiting on the GPU. Only texels a triangle fully covers are written, with the furthest depth over the texel
+	static void MobileCpuRasterizeOccluders(const FMobileHzbBufferLayout& Layout, const FMatrix& WorldToClip, TArrayView<const FMobileHzbOccluder> Occluders, float* OutHzbBuffer);
+	//Occluders are moved into the task, wait the returned event before touching MobileHZBBuffer_CPU
+	FGraphEventRef MobileCpuRasterizeOccludersAsync(const FMatrix& WorldToClip, TArray<FMobileHzbOccluder>&& Occluders);
+	//Occluders of the next build of this view, whoever gathers the flagged meshes hands them over here. Render thread, replaces the previous set
+	static void SetViewOccluders(const FSceneViewState* ViewState, TArray<FMobileHzbOccluder>&& Occluders);
+	//r.GpuDriven.MobileHZB.CpuOccluders, MobileBuildHzbBatched calls it with the SetViewOccluders set before its SceneDepth build.
+	//Returns the raster task for CPU queries, nullptr when nothing was launched. Mode 2 waits for it and uploads the result, the SceneDepth build of this frame is then skipped
+	static FGraphEventRef MobileRasterizeOccluders(FRHICommandListImmediate& RHICmdList, const FViewInfo& View, TArray<FMobileHzbOccluder>&& Occluders);
+	//MobileHZBBuffer_CPU -> MobileHZBPooledBuffer at BufferBaseOffset, the closest plane is cleared to the near plane
+	void UploadCpuHzb(FRHICommandListImmediate& RHICmdList);
+
+	//CPU Query, port of IsVisibleHZBStorageBufferDownSampleUnreal4. Bit i of OutVisibilityMask is set when bounds i is visible
+	static void MobileCpuQueryVisibility(const FMobileHzbBufferLayout& Layout, const float* HzbBuffer, const FMobileHzbQueryBatch& Batch, TArray<uint32>& OutVisibilityMask);
+	void MobileCpuQueryVisibility(const FMobileHzbQueryBatch& Batch, TArray<uint32>& OutVisibilityMask) const;
+	//GPU Query over FMobileHzbInstanceBounds, same bit order as the CPU one. 4 loads per bounds at the mip its footprint spans 2x2 texels
+	void MobileGpuQueryVisibility(FRHICommandList& RHICmdList, const FViewInfo& View, FRHIShaderResourceView* BoundsSRV, const uint32 NumBounds, FRWBuffer& OutVisibilityBits);
+
+	//FP16 StorageBuffer rounding, twins of PackHZBFurthestDepth and PackHZBClosestDepth of MobileHZB.ush
+	static FFloat16 QuantizeFurthestDepth(const float DeviceZ);
+	static FFloat16 QuantizeClosestDepth(const float DeviceZ);
+
+	//GPU instance culling against the StorageBuffer HZB, one dispatch writes the compacted instance ids and the DrawIndexedIndirect args of every batch
+	void MobileCullInstances(FRHICommandList& RHICmdList, const FViewInfo& View, FRHIShaderResourceView* InstanceBoundsSRV, const uint32 NumInstances, FRHIShaderResourceView* DrawBatchesSRV, const uint32 NumBatches, FMobileHzbInstanceCullingResult& OutResult, const EMobileHzbCullingPhase Phase = EMobileHzbCullingPhase::Single);
+	void InitInstanceVisibilityBits(FRHICommandList& RHICmdList, const uint32 NumInstances);
+	static bool IsTwoPhaseCullingEnabled();
+	//Culling flow of one view. DrawCulled records the DrawIndexedIndirect of every batch from the result it gets, inside its own render pass.
+	//Two phase draws twice and builds the HZB in between, the renderer must not build it again for this view. False without a HzbSystem, draw unculled.
+	//Entry point of the GPU driven mobile base pass, which is not part of this tree yet: nothing calls it
+	static bool MobileCullAndDrawInstances(FRHICommandListImmediate& RHICmdList, const FViewInfo& View, FRHIShaderResourceView* InstanceBoundsSRV, const uint32 NumInstances, FRHIShaderResourceView* DrawBatchesSRV, const uint32 NumBatches, FMobileHzbInstanceCullingResult& OutResult, TFunctionRef<void(FRHICommandListImmediate&, const FMobileHzbInstanceCullingResult&)> DrawCulled);
+
+	//Light view HZB per shadow cascade, r.GpuDriven.MobileHZB.ShadowCasterCulling. Same reduction kernels fed by last frame's shadow depth, own size per cascade.
+	//Cascades must keep the matrices that shadow depth was rendered with, casters are tested in that light space
+	static void AddBuildShadowHzbPasses(FRDGBuilder& GraphBuilder, const FViewInfo& View, FRDGTextureRef ShadowDepthTexture, TArrayView<const FMobileHzbShadowCascade> Cascades);
+	//Caster culling against one cascade, same batches and result as MobileCullInstances. A caster behind the shadow depth of its whole footprint only lands on receivers already in shadow.
+	//False without a built cascade HZB, OutResult is untouched and the casters have to be drawn unculled
+	bool MobileCullShadowCasters(FRHICommandList& RHICmdList, const FViewInfo& View, const int32 CascadeIndex, FRHIShaderResourceView* InstanceBoundsSRV, const uint32 NumInstances, FRHIShaderResourceView* DrawBatchesSRV, const uint32 NumBatches, FMobileHzbInstanceCullingResult& OutResult);
+	static FMobileHzbBufferLayout ComputeShadowBufferLayout(const FIntPoint CascadeSize);
+
+	//Readback, N frames in flight, never waits on the GPU. The copy is a readback pass of the graph that built the HZB
+	void AddReadbackPass(FRDGBuilder& GraphBuilder, const FViewInfo& View);
+	void PollReadback();
+	const FMobileHzbReadbackResult* GetLatestReadback() const { return LatestReadback.HzbBuffer.Num() > 0 ? &LatestReadback : nullptr; }
+	//r.GpuDriven.MobileHZB.ValidateReadback, checks the GPU reduction of every new readback against the CPU one. Development builds only
+	void ValidateLatestReadback();
+	//System.Renderer.MobileHZB.GpuReadback, builds SceneDepth into a standalone system with the current build cvars and waits for its readback. Development builds only
+	static void BuildAndReadbackTestHzb(FRHICommandListImmediate& RHICmdList, const FMobileHzbBufferLayout& Layout, const TArray<float>& SceneDepth, const FIntPoint SceneDepthSize, TArray<float>& OutHzbBuffer);
+
 	int32 NumMips;
 	FIntPoint HzbSize;
-	FRWBufferStructured MobileHZBBuffer_GPU;
+	TRefCountPtr<FRDGPooledBuffer> MobileHZBPooledBuffer; //May be shared by the views of one batched build, this view starts at BufferBaseOffset
+	FShaderResourceViewRHIRef MobileHZBBufferSRV; //Owned by the pool entry, for the shaders bound outside a graph
+	uint32 BufferBaseOffset;
 	TRefCountPtr<IPooledRenderTarget> MobileHZBTexture;
-	TArray<FShaderResourceViewRHIRef> MipSRVs;
-	TArray<FUnorderedAccessViewRHIRef> MipUAVs;
+	TArray<float> MobileHZBBuffer_CPU;
+	FGraphEventRef CpuHzbTask; //Last task writing MobileHZBBuffer_CPU, waited before the array is resized or the system dies
+	FMobileHzbBufferLayout BufferLayout;
+	FRWBuffer InstanceVisibilityBits; //Two phase culling, 1 bit per instance of this view
+	FViewMatrices HzbViewMatrices; //Camera MobileHZBPooledBuffer currently matches
+	//Camera the occlusion tests project with, culling a moved camera against last frame's HZB with this frame's matrices over-culls
+	const FViewMatrices& GetHzbViewMatrices(const FViewInfo& View) const;
+	bool IsHzbViewMoved(const FViewInfo& View) const;
+	bool bHzbViewMatricesValid;
+
+	TArray<FMobileHzbReadbackSlot> ReadbackRing;
+	int32 ReadbackWriteIndex;
+	FMobileHzbReadbackResult LatestReadback;
+	uint32 ValidatedReadbackFrame;
+
+	uint32 LastRenderFrame;
+
+	//Temporal reuse, world bounds of the occluders changed since the last build of this view
+	TArray<FBox> DirtyOccluderBounds;
+	bool bAllOccludersDirty;
+	FViewMatrices TemporalViewMatrices; //Camera of the last full build
+	FIntRect TemporalViewRect;
+	int32 TemporalNumPrimitives; //Scene primitive count of the last full build
+	uint32 LastFullBuildFrame;
+	bool bTemporalHistoryValid; //Mip 0 holds the depth of the last build, false after reprojection or reallocation
+
+	uint32 CpuOccluderUploadFrame; //Frame MobileHZBPooledBuffer was last uploaded from the CPU occluder rasterizer
+	TArray<FMobileHzbOccluder> PendingOccluders; //SetViewOccluders, consumed by the next build
 
-	static TMap<uint32, TUniquePtr<FMobileHzbSystem>> ViewUniqueId2HzbSystemMap;
+	//Light view HZB, one system per cascade owned by the view. Their HZB is inverted shadow depth in the space of LightViewWorldToClip
+	TArray<TUniquePtr<FMobileHzbSystem>> ShadowCascadeHzbs;
+	bool bLightViewHzb;
+	FMatrix LightViewWorldToClip;
+
+	static FMobileHzbSystemRegistry SystemRegistry;
 
-#if USE_LOW_RESLUTION
 	static constexpr int32 GroupSizeX = 8;
 	static constexpr int32 GroupSizeY = 8;
 	static constexpr int32 kHzbTexWidth = 256;
 	static constexpr int32 kHzbTexHeight = 128;
 	static constexpr uint8 kHZBMaxMipmap = 8;
-#else
-	static constexpr int32 GroupSizeX = 16;
-	static constexpr int32 GroupSizeY = 16;
-	static constexpr int32 kHzbTexWidth = 512;
-	static constexpr int32 kHzbTexHeight = 256;
-	static constexpr uint8 kHZBMaxMipmap = 9;
-#endif
 
 	static constexpr bool bUsePixelShader = false;
 	static constexpr bool bUseTextureResources = false;
@@ -56,4 +364,115 @@ struct FMobileHzbSystem {
 	
 	static constexpr int32 ComputeShaderBuildBatch = 4;
 	static constexpr int32 GroupTileSize = 8;
+	static constexpr int32 kMinHzbSize = 64;
+	static constexpr int32 kMaxHzbSize = 2048;
+	static constexpr int32 kMaxDirtyOccluderBounds = 32; //More dirties the whole screen
+
+	//Row-major element offset of MipLevel in the fixed kHzbTexWidth x kHzbTexHeight chain, HZBFixedMipOffset of MobileHZB.ush is generated from it
+	static constexpr uint32 GetFixedMipOffset(const int32 MipLevel) {
+		uint32 Offset = 0;
+		for (int32 Level = 0; Level < MipLevel; ++Level) {
+			Offset += uint32(kHzbTexWidth >> Level) * uint32(kHzbTexHeight >> Level);
+		}
+		return Offset;
+	}
+
+	//Only the path the constexpr configuration above builds with is cooked
+	static bool ShouldCompileBufferShaders(const FGlobalShaderPermutationParameters& Parameters);
+	static bool ShouldCompileTextureShaders(const FGlobalShaderPermutationParameters& Parameters);
+	//Fixed HZB size, mip offsets and the limits the shaders must match, every HZB shader compiles against this one source
+	static void ModifyHzbCompilationEnvironment(FShaderCompilerEnvironment& OutEnvironment);
+};
+
+static_assert(FMobileHzbSystem::kHZBMaxMipmap <= FMobileHzbBufferLayout::kMaxMipCount, "Fixed HZB has more mips than the shader layout tables");
+static_assert(FMobileHzbSystem::GetFixedMipOffset(1) == uint32(FMobileHzbSystem::kHzbTexWidth * FMobileHzbSystem::kHzbTexHeight), "Fixed HZB mip 1 must follow mip 0");
+
+//ViewState UniqueID -> HzbSystem slot table, lookups are safe from any thread.
+//Find hands out a reference taken under the lock, a system unregistered meanwhile dies with the last reference
+class FMobileHzbSystemRegistry {
+public:
+	void Register(const uint32 SceneViewStateUniqueID);
+	void Unregister(const uint32 SceneViewStateUniqueID);
+	FMobileHzbSystemRef Find(const uint32 SceneViewStateUniqueID) const;
+
+	//Function runs under the read lock, it must not register or unregister
+	template<typename FunctionType>
+	void ForEach(FunctionType&& Function) const {
+		FReadScopeLock ReadLock(Lock);
+		for (const FMobileHzbSystemRef& System : Slots) {
+			Function(*System);
+		}
+	}
+
+private:
+	mutable FRWLock Lock;
+	TSparseArray<FMobileHzbSystemRef> Slots;
+	TMap<uint32, int32> ViewIdToSlot;
 };
+
+//Size bucketed StorageBuffer HZB storage shared by all view states. Every buffer counts its owners: Acquire gives the caller one,
+//AddOwner one more for views sharing it and Release drops one. A buffer without owner is reused first,
+//and destroyed after staying unowned for r.GpuDriven.MobileHZB.PoolReleaseFrames. Render thread only
+class FMobileHzbBufferPool : public FRenderResource {
+public:
+	//Allocated from GRenderGraphResourcePool, RDG tracks its state across graphs. OutSRV is for the shaders bound outside a graph
+	TRefCountPtr<FRDGPooledBuffer> Acquire(const uint32 NumElements, const uint32 FrameNumber, FShaderResourceViewRHIRef& OutSRV);
+	void AddOwner(const FRDGPooledBuffer* PooledBuffer);
+	//Unknown buffers are ignored, the pool may already be released at shutdown
+	void Release(const FRDGPooledBuffer* PooledBuffer, const uint32 FrameNumber);
+	//Once per frame, later calls of the same frame return false
+	bool BeginFrame(const uint32 FrameNumber);
+	void Tick(const uint32 FrameNumber, const uint32 ReleaseFrames);
+	uint64 GetAllocatedBytes() const;
+
+	virtual void ReleaseDynamicRHI() override;
+
+private:
+	struct FEntry {
+		TRefCountPtr<FRDGPooledBuffer> PooledBuffer;
+		FShaderResourceViewRHIRef SRV;
+		int32 NumOwners;
+		uint32 FreedFrame; //Frame the last owner released it
+	};
+
+	FEntry* FindEntry(const FRDGPooledBuffer* PooledBuffer);
+
+	uint32 LastTickFrame = MAX_uint32;
+
+	static constexpr int32 kNumBuckets = 32; //Power of two element counts
+	TArray<FEntry> Buckets[kNumBuckets];
+};
+
+extern TGlobalResource<FMobileHzbBufferPool> GMobileHzbBufferPool;
+
+//STATGROUP_MobileHZB and MobileHZB CSV columns. GPU counters come back through a readback ring a few frames late,
+//CPU counters are added from any thread. Both are published and reset once per render frame
+class FMobileHzbStats : public FRenderResource {
+public:
+	static bool IsEnabled();
+	//Render thread, once per frame, later calls of the same frame return right away
+	void Tick(FRHICommandList& RHICmdList);
+	//Counters of the culling dispatches of this frame, cleared by the first call of the frame. Left in UAVCompute
+	FRHIUnorderedAccessView* GetGPUCounterUAV(FRHICommandList& RHICmdList);
+	void AddCPUCounters(const uint32* Counters);
+
+	virtual void ReleaseDynamicRHI() override;
+
+private:
+	static constexpr int32 kNumReadbacks = 4;
+
+	void Publish(const uint32* GPUCounters, const uint32* CPUCounters);
+
+	FRWBuffer GPUCounters;
+	ERHIAccess GPUCounterAccess = ERHIAccess::Unknown;
+	bool bGPUCountersWritten = false;
+	uint32 ClearFrameNumber = ~0u;
+	uint32 TickFrameNumber = ~0u;
+	TUniquePtr<FRHIGPUBufferReadback> Readbacks[kNumReadbacks];
+	bool bReadbackPending[kNumReadbacks] = {};
+	int32 ReadbackWriteIndex = 0;
+	uint32 LatestGPUCounters[EMobileHzbStatCounter::Num] = {};
+	FThreadSafeCounter CPUCounters[EMobileHzbStatCounter::Num];
+};
+
+extern TGlobalResource<FMobileHzbStats> GMobileHzbStats;
@@ -0,0 +1,410 @@
+#include "MobileHZB.h"
+#include "RendererModule.h"
+#include "Math/VectorRegister.h"
+#include "Async/ParallelFor.h"
+
+DECLARE_CYCLE_STAT(TEXT("CPU Query"), STAT_MobileHZB_CPUQuery, STATGROUP_MobileHZB);
+
+FMobileHzbBufferLayout::FMobileHzbBufferLayout(const FIntPoint InHzbSize, const int32 InNumMips, const bool bInMinMax, const bool bInPackedFP16, const bool bInTiled)
+	: HzbSize(InHzbSize)
+	, NumMips(InNumMips)
+	, NumElements(0)
+	, ClosestPlaneOffset(0)
+	, bPackedFP16(bInPackedFP16)
+	, bTiled(bInTiled)
+{
+	check(NumMips > 0 && NumMips <= kMaxMipCount);
+	const uint32 OffsetAlignment = bPackedFP16 ? 2 : 1;
+	for (int32 MipLevel = 0; MipLevel < kMaxMipCount; ++MipLevel) {
+		if (MipLevel < NumMips) {
+			MipSize[MipLevel] = FIntPoint(FMath::Max(FMath::DivideAndRoundUp(HzbSize.X, 1 << MipLevel), 1), FMath::Max(FMath::DivideAndRoundUp(HzbSize.Y, 1 << MipLevel), 1));
+			NumElements = Align(NumElements, OffsetAlignment);
+			MipOffset[MipLevel] = NumElements;
+			NumElements += bTiled
+				? Align(MipSize[MipLevel].X, kTileSize) * Align(MipSize[MipLevel].Y, kTileSize)
+				: MipSize[MipLevel].X * MipSize[MipLevel].Y;
+		}
+		else {
+			MipSize[MipLevel] = FIntPoint::ZeroValue;
+			MipOffset[MipLevel] = NumElements;
+		}
+	}
+	NumElements = Align(NumElements, OffsetAlignment);
+	ClosestPlaneOffset = bInMinMax ? NumElements : 0;
+}
+
+const FMobileHzbBufferLayout& FMobileHzbSystem::GetDefaultBufferLayout() {
+	//256x128 -> 0x8000, 0xA000, 0xA800 ... same as the table in MobileHZB.ush
+	static const FMobileHzbBufferLayout DefaultLayout(FIntPoint(FMobileHzbSystem::kHzbTexWidth, FMobileHzbSystem::kHzbTexHeight), FMobileHzbSystem::kHZBMaxMipmap);
+	return DefaultLayout;
+}
+
+namespace MobileHzbCpu
+{
+	//GatherRed with point clamp sampler reads texel floor(UV * Size - 0.5) and its right/bottom neighbour
+	static void ComputeGatherTexels(const int32 DstSize, const int32 SrcSize, TArray<int32>& OutTexel0, TArray<int32>& OutTexel1) {
+		OutTexel0.SetNumUninitialized(DstSize);
+		OutTexel1.SetNumUninitialized(DstSize);
+		const float InvDstSize = 1.f / DstSize;
+		for (int32 Index = 0; Index < DstSize; ++Index) {
+			const float TexelCoord = float(Index) * InvDstSize * SrcSize - 0.5f;
+			const int32 Texel = FMath::FloorToInt(TexelCoord);
+			OutTexel0[Index] = FMath::Clamp(Texel, 0, SrcSize - 1);
+			OutTexel1[Index] = FMath::Clamp(Texel + 1, 0, SrcSize - 1);
+		}
+	}
+
+	static void MinRows(const float* RESTRICT Row0, const float* RESTRICT Row1, float* RESTRICT OutRow, const int32 Width) {
+		int32 X = 0;
+		for (; X + 4 <= Width; X += 4) {
+			VectorStore(VectorMin(VectorLoad(Row0 + X), VectorLoad(Row1 + X)), OutRow + X);
+		}
+		for (; X < Width; ++X) {
+			OutRow[X] = FMath::Min(Row0[X], Row1[X]);
+		}
+	}
+
+	//Any layout, one texel at a time through GetElementIndex
+	static void ReduceMipGeneric(const FMobileHzbBufferLayout& Layout, float* InOutHzbBuffer, const int32 MipLevel) {
+		const FIntPoint ParentSize = Layout.GetMipSize(MipLevel - 1);
+		const FIntPoint ChildSize = Layout.GetMipSize(MipLevel);
+		for (int32 Y = 0; Y < ChildSize.Y; ++Y) {
+			const int32 Y0 = FMath::Min(Y * 2, ParentSize.Y - 1);
+			const int32 Y1 = FMath::Min(Y * 2 + 1, ParentSize.Y - 1);
+			for (int32 X = 0; X < ChildSize.X; ++X) {
+				const int32 X0 = FMath::Min(X * 2, ParentSize.X - 1);
+				const int32 X1 = FMath::Min(X * 2 + 1, ParentSize.X - 1);
+				const float Depth_0 = FMath::Min(InOutHzbBuffer[Layout.GetElementIndex(MipLevel - 1, X0, Y0)], InOutHzbBuffer[Layout.GetElementIndex(MipLevel - 1, X1, Y0)]);
+				const float Depth_1 = FMath::Min(InOutHzbBuffer[Layout.GetElementIndex(MipLevel - 1, X0, Y1)], InOutHzbBuffer[Layout.GetElementIndex(MipLevel - 1, X1, Y1)]);
+				InOutHzbBuffer[Layout.GetElementIndex(MipLevel, X, Y)] = FMath::Min(Depth_0, Depth_1);
+			}
+		}
+	}
+
+	//Same HzbSize and NumMips, only the texel addressing differs. Tile padding is left untouched
+	static void ConvertLayout(const FMobileHzbBufferLayout& SrcLayout, const float* SrcHzbBuffer, const FMobileHzbBufferLayout& DstLayout, float* DstHzbBuffer) {
+		check(SrcLayout.HzbSize == DstLayout.HzbSize && SrcLayout.NumMips == DstLayout.NumMips);
+		for (int32 MipLevel = 0; MipLevel < SrcLayout.NumMips; ++MipLevel) {
+			const FIntPoint MipSize = SrcLayout.GetMipSize(MipLevel);
+			for (int32 Y = 0; Y < MipSize.Y; ++Y) {
+				for (int32 X = 0; X < MipSize.X; ++X) {
+					DstHzbBuffer[DstLayout.GetElementIndex(MipLevel, X, Y)] = SrcHzbBuffer[SrcLayout.GetElementIndex(MipLevel, X, Y)];
+				}
+			}
+		}
+	}
+
+	//2x2 min reduction of one mip, odd parent edges are clamped like the GPU reads
+	static void ReduceMip(const float* RESTRICT Parent, const FIntPoint ParentSize, float* RESTRICT Child, const FIntPoint ChildSize) {
+		for (int32 Y = 0; Y < ChildSize.Y; ++Y) {
+			const float* Row0 = Parent + FMath::Min(Y * 2, ParentSize.Y - 1) * ParentSize.X;
+			const float* Row1 = Parent + FMath::Min(Y * 2 + 1, ParentSize.Y - 1) * ParentSize.X;
+			float* OutRow = Child + Y * ChildSize.X;
+
+			int32 X = 0;
+			for (; X + 4 <= ChildSize.X && X * 2 + 8 <= ParentSize.X; X += 4) {
+				const VectorRegister Min0 = VectorMin(VectorLoad(Row0 + X * 2), VectorLoad(Row1 + X * 2));
+				const VectorRegister Min1 = VectorMin(VectorLoad(Row0 + X * 2 + 4), VectorLoad(Row1 + X * 2 + 4));
+				const VectorRegister Even = VectorShuffle(Min0, Min1, 0, 2, 0, 2);
+				const VectorRegister Odd = VectorShuffle(Min0, Min1, 1, 3, 1, 3);
+				VectorStore(VectorMin(Even, Odd), OutRow + X);
+			}
+			for (; X < ChildSize.X; ++X) {
+				const int32 X0 = FMath::Min(X * 2, ParentSize.X - 1);
+				const int32 X1 = FMath::Min(X * 2 + 1, ParentSize.X - 1);
+				OutRow[X] = FMath::Min(FMath::Min(Row0[X0], Row0[X1]), FMath::Min(Row1[X0], Row1[X1]));
+			}
+		}
+	}
+}
+
+void FMobileHzbSystem::MobileCpuReduceMips(const FMobileHzbBufferLayout& Layout, float* InOutHzbBuffer, const int32 StartMipLevel) {
+	if (Layout.bTiled) {
+		for (int32 MipLevel = FMath::Max(StartMipLevel, 1); MipLevel < Layout.NumMips; ++MipLevel) {
+			MobileHzbCpu::ReduceMipGeneric(Layout, InOutHzbBuffer, MipLevel);
+		}
+		return;
+	}
+
+	for (int32 MipLevel = FMath::Max(StartMipLevel, 1); MipLevel < Layout.NumMips; ++MipLevel) {
+		MobileHzbCpu::ReduceMip(
+			InOutHzbBuffer + Layout.GetMipOffset(MipLevel - 1),
+			Layout.GetMipSize(MipLevel - 1),
+			InOutHzbBuffer + Layout.GetMipOffset(MipLevel),
+			Layout.GetMipSize(MipLevel));
+	}
+}
+
+int32 FMobileHzbSystem::CountReduceMismatches(const FMobileHzbBufferLayout& Layout, const float* HzbBuffer, const int32 FirstMipLevel) {
+	TArray<float> ReducedHzbBuffer(HzbBuffer, Layout.NumElements);
+	MobileCpuReduceMips(Layout, ReducedHzbBuffer.GetData(), FirstMipLevel + 1);
+	int32 NumMismatches = 0;
+	for (int32 MipLevel = FirstMipLevel + 1; MipLevel < Layout.NumMips; ++MipLevel) {
+		const FIntPoint MipSize = Layout.GetMipSize(MipLevel);
+		for (int32 Y = 0; Y < MipSize.Y; ++Y) {
+			for (int32 X = 0; X < MipSize.X; ++X) {
+				const uint32 Index = Layout.GetElementIndex(MipLevel, X, Y);
+				NumMismatches += ReducedHzbBuffer[Index] != HzbBuffer[Index] ? 1 : 0;
+			}
+		}
+	}
+	return NumMismatches;
+}
+
+void FMobileHzbSystem::MobileCpuBuildHZB(const FMobileHzbBufferLayout& Layout, const float* SceneDepth, const FIntPoint SceneDepthSize, float* OutHzbBuffer) {
+	check(Layout.NumMips > 0 && SceneDepthSize.X > 0 && SceneDepthSize.Y > 0);
+
+	if (Layout.bTiled) {
+		//The SIMD row code needs contiguous rows, build row-major then swizzle
+		const FMobileHzbBufferLayout RowMajorLayout(Layout.HzbSize, Layout.NumMips);
+		TArray<float> RowMajorHzbBuffer;
+		RowMajorHzbBuffer.SetNumUninitialized(RowMajorLayout.NumElements);
+		MobileCpuBuildHZB(RowMajorLayout, SceneDepth, SceneDepthSize, RowMajorHzbBuffer.GetData());
+		MobileHzbCpu::ConvertLayout(RowMajorLayout, RowMajorHzbBuffer.GetData(), Layout, OutHzbBuffer);
+		return;
+	}
+
+	//Level0, same footprint as HZBBuildCSLevelZero: UV = DispatchThreadId / HzbSize then GatherRed
+	TArray<int32> TexelX0, TexelX1, TexelY0, TexelY1;
+	MobileHzbCpu::ComputeGatherTexels(Layout.HzbSize.X, SceneDepthSize.X, TexelX0, TexelX1);
+	MobileHzbCpu::ComputeGatherTexels(Layout.HzbSize.Y, SceneDepthSize.Y, TexelY0, TexelY1);
+
+	TArray<float> VerticalMinRow;
+	VerticalMinRow.SetNumUninitialized(SceneDepthSize.X);
+	for (int32 Y = 0; Y < Layout.HzbSize.Y; ++Y) {
+		MobileHzbCpu::MinRows(SceneDepth + TexelY0[Y] * SceneDepthSize.X, SceneDepth + TexelY1[Y] * SceneDepthSize.X, VerticalMinRow.GetData(), SceneDepthSize.X);
+		float* OutRow = OutHzbBuffer + Layout.GetElementIndex(0, 0, Y);
+		for (int32 X = 0; X < Layout.HzbSize.X; ++X) {
+			OutRow[X] = FMath::Min(VerticalMinRow[TexelX0[X]], VerticalMinRow[TexelX1[X]]);
+		}
+	}
+
+	MobileCpuReduceMips(Layout, OutHzbBuffer, 1);
+}
+
+FGraphEventRef FMobileHzbSystem::MobileCpuBuildHZBAsync(TArray<float>&& SceneDepth, const FIntPoint SceneDepthSize) {
+	check(SceneDepth.Num() == SceneDepthSize.X * SceneDepthSize.Y);
+	//The previous task may still write the array, BufferLayout may be reallocated before this one runs
+	WaitCpuHzbTask();
+	const FMobileHzbBufferLayout Layout = BufferLayout;
+	MobileHZBBuffer_CPU.SetNumUninitialized(Layout.NumElements);
+
+	CpuHzbTask = FFunctionGraphTask::CreateAndDispatchWhenReady(
+		[Layout, SceneDepthSize, LocalSceneDepth = MoveTemp(SceneDepth), OutHzbBuffer = MobileHZBBuffer_CPU.GetData()]() {
+			MobileCpuBuildHZB(Layout, LocalSceneDepth.GetData(), SceneDepthSize, OutHzbBuffer);
+		},
+		TStatId(), nullptr, ENamedThreads::AnyBackgroundThreadNormalTask);
+	return CpuHzbTask;
+}
+
+void FMobileHzbSystem::WaitCpuHzbTask() {
+	if (CpuHzbTask.IsValid()) {
+		FTaskGraphInterface::Get().WaitUntilTaskCompletes(CpuHzbTask);
+		CpuHzbTask.SafeRelease();
+	}
+}
+
+namespace MobileHzbCpu
+{
+	//Multiple of 32, every chunk owns its own mask words so workers never share a uint32
+	static constexpr int32 kQueryChunkSize = 1024;
+	static constexpr int32 kQueryLaneCount = 4;
+
+	//FMath::RoundHalfToEven of non-negative lanes
+	static FORCEINLINE VectorRegister VectorRoundHalfToEven(const VectorRegister Value) {
+		const VectorRegister Half = VectorSetFloat1(0.5f);
+		const VectorRegister Integer = VectorTruncate(Value);
+		const VectorRegister Fraction = VectorSubtract(Value, Integer);
+		const VectorRegister Odd = VectorCompareEQ(VectorSubtract(Integer, VectorMultiply(VectorTruncate(VectorMultiply(Integer, Half)), VectorSetFloat1(2.f))), VectorOne());
+		const VectorRegister RoundUp = VectorBitwiseOr(VectorCompareGT(Fraction, Half), VectorBitwiseAnd(VectorCompareEQ(Fraction, Half), Odd));
+		return VectorAdd(Integer, VectorBitwiseAnd(RoundUp, VectorOne()));
+	}
+
+	//GetElementIndex per lane, X and Y are whole floats of the mip each lane samples. Exact, every index is far below 2^24
+	static FORCEINLINE VectorRegister VectorGetElementIndex(const bool bTiled, const VectorRegister MipOffset, const VectorRegister MipPitch, const VectorRegister X, const VectorRegister Y) {
+		if (bTiled) {
+			const VectorRegister TileSize = VectorSetFloat1(float(FMobileHzbBufferLayout::kTileSize));
+			const VectorRegister InvTileSize = VectorSetFloat1(1.f / FMobileHzbBufferLayout::kTileSize);
+			const VectorRegister TileX = VectorTruncate(VectorMultiply(X, InvTileSize));
+			const VectorRegister TileY = VectorTruncate(VectorMultiply(Y, InvTileSize));
+			const VectorRegister TileIndex = VectorMultiplyAdd(TileY, MipPitch, TileX);
+			const VectorRegister InTile = VectorMultiplyAdd(VectorSubtract(Y, VectorMultiply(TileY, TileSize)), TileSize, VectorSubtract(X, VectorMultiply(TileX, TileSize)));
+			return VectorAdd(VectorMultiplyAdd(TileIndex, VectorMultiply(TileSize, TileSize), MipOffset), InTile);
+		}
+		return VectorAdd(MipOffset, VectorMultiplyAdd(Y, MipPitch, X));
+	}
+
+	//No gather on SSE/NEON, the only per lane part of the query
+	static FORCEINLINE VectorRegister VectorGatherDepth(const float* HzbBuffer, const VectorRegister ElementIndex) {
+		MS_ALIGN(16) float Index[kQueryLaneCount] GCC_ALIGN(16);
+		VectorStoreAligned(ElementIndex, Index);
+		return MakeVectorRegister(HzbBuffer[uint32(Index[0])], HzbBuffer[uint32(Index[1])], HzbBuffer[uint32(Index[2])], HzbBuffer[uint32(Index[3])]);
+	}
+
+	//OutCounters is null unless r.GpuDriven.MobileHZB.Stats is on
+	static void QueryChunk(const FMobileHzbBufferLayout& Layout, const float* HzbBuffer, const FMobileHzbQueryBatch& Batch, const int32 Start, const int32 End, uint32* OutMask, uint32* OutCounters) {
+		const float Width = float(Layout.HzbSize.X);
+		const float Height = float(Layout.HzbSize.Y);
+		const VectorRegister Half = VectorSetFloat1(0.5f);
+		const VectorRegister NegHalf = VectorSetFloat1(-0.5f);
+		const VectorRegister Zero = VectorZero();
+		const VectorRegister WidthVec = VectorSetFloat1(Width);
+		const VectorRegister HeightVec = VectorSetFloat1(Height);
+		const VectorRegister HalfWidthVec = VectorSetFloat1(Width * 0.5f);
+		const VectorRegister HalfHeightVec = VectorSetFloat1(Height * 0.5f);
+		const VectorRegister MaxPosX = VectorSetFloat1(Width - 1.f);
+		const VectorRegister MaxPosY = VectorSetFloat1(Height - 1.f);
+
+		//Per mip, picked per lane by the same compares that select the mip
+		VectorRegister MipOffset[FMobileHzbBufferLayout::kMaxMipCount];
+		VectorRegister MipPitch[FMobileHzbBufferLayout::kMaxMipCount];
+		VectorRegister MipScale[FMobileHzbBufferLayout::kMaxMipCount];
+		VectorRegister MipThreshold[FMobileHzbBufferLayout::kMaxMipCount];
+		for (int32 MipLevel = 0; MipLevel < Layout.NumMips; ++MipLevel) {
+			const int32 MipWidth = Layout.GetMipSize(MipLevel).X;
+			MipOffset[MipLevel] = VectorSetFloat1(float(Layout.GetMipOffset(MipLevel)));
+			MipPitch[MipLevel] = VectorSetFloat1(float(Layout.bTiled ? FMath::DivideAndRoundUp(MipWidth, FMobileHzbBufferLayout::kTileSize) : MipWidth));
+			MipScale[MipLevel] = VectorSetFloat1(1.f / float(1 << MipLevel));
+			MipThreshold[MipLevel] = VectorSetFloat1(float(1 << MipLevel));
+		}
+
+		MS_ALIGN(16) float Padded[4][kQueryLaneCount] GCC_ALIGN(16);
+		MS_ALIGN(16) float SampleLevel[kQueryLaneCount] GCC_ALIGN(16);
+
+		for (int32 Base = Start; Base < End; Base += kQueryLaneCount) {
+			const int32 NumLanes = FMath::Min(kQueryLaneCount, End - Base);
+			VectorRegister MinX, MinY, MaxX, MaxY, MaxZ;
+			if (NumLanes == kQueryLaneCount) {
+				MinX = VectorLoad(&Batch.NDCMinX[Base]);
+				MinY = VectorLoad(&Batch.NDCMinY[Base]);
+				MaxX = VectorLoad(&Batch.NDCMaxX[Base]);
+				MaxY = VectorLoad(&Batch.NDCMaxY[Base]);
+				MaxZ = VectorLoad(&Batch.MaxZ[Base]);
+			}
+			else {
+				//Tail, pad with empty rects, their bits are masked out below
+				FMemory::Memzero(Padded, sizeof(Padded));
+				for (int32 Lane = 0; Lane < NumLanes; ++Lane) {
+					Padded[0][Lane] = Batch.NDCMinX[Base + Lane];
+					Padded[1][Lane] = Batch.NDCMinY[Base + Lane];
+					Padded[2][Lane] = Batch.NDCMaxX[Base + Lane];
+					Padded[3][Lane] = Batch.NDCMaxY[Base + Lane];
+				}
+				MinX = VectorLoadAligned(Padded[0]);
+				MinY = VectorLoadAligned(Padded[1]);
+				MaxX = VectorLoadAligned(Padded[2]);
+				MaxY = VectorLoadAligned(Padded[3]);
+				MaxZ = Zero;
+			}
+
+			//Rect = (NDCRect * float2(0.5, -0.5).xyxy + 0.5).xwzy
+			const VectorRegister RectX0 = VectorMultiplyAdd(MinX, Half, Half);
+			const VectorRegister RectY0 = VectorMultiplyAdd(MaxY, NegHalf, Half);
+			const VectorRegister RectX1 = VectorMultiplyAdd(MaxX, Half, Half);
+			const VectorRegister RectY1 = VectorMultiplyAdd(MinY, NegHalf, Half);
+
+			const VectorRegister SizeX = VectorMultiply(VectorSubtract(RectX1, RectX0), HalfWidthVec);
+			const VectorRegister SizeY = VectorMultiply(VectorSubtract(RectY1, RectY0), HalfHeightVec);
+			const VectorRegister RectSize = VectorMax(SizeX, SizeY);
+
+			//ceil(log2(RectSize)) clamped to the chain is the number of mips whose texel is still smaller than RectSize
+			VectorRegister Level = Zero;
+			VectorRegister Offset = MipOffset[0];
+			VectorRegister Pitch = MipPitch[0];
+			VectorRegister Scale = MipScale[0];
+			for (int32 MipLevel = 1; MipLevel < Layout.NumMips; ++MipLevel) {
+				const VectorRegister Coarser = VectorCompareGT(RectSize, MipThreshold[MipLevel - 1]);
+				Level = VectorAdd(Level, VectorBitwiseAnd(Coarser, VectorOne()));
+				Offset = VectorSelect(Coarser, MipOffset[MipLevel], Offset);
+				Pitch = VectorSelect(Coarser, MipPitch[MipLevel], Pitch);
+				Scale = VectorSelect(Coarser, MipScale[MipLevel], Scale);
+			}
+
+			const VectorRegister SampleX0 = VectorRoundHalfToEven(VectorMin(VectorMax(VectorMultiplyAdd(RectX0, WidthVec, NegHalf), Zero), MaxPosX));
+			const VectorRegister SampleY0 = VectorRoundHalfToEven(VectorMin(VectorMax(VectorMultiplyAdd(RectY0, HeightVec, NegHalf), Zero), MaxPosY));
+			const VectorRegister SampleX1 = VectorRoundHalfToEven(VectorMin(VectorMax(VectorMultiplyAdd(RectX1, WidthVec, NegHalf), Zero), MaxPosX));
+			const VectorRegister SampleY1 = VectorRoundHalfToEven(VectorMin(VectorMax(VectorMultiplyAdd(RectY1, HeightVec, NegHalf), Zero), MaxPosY));
+
+			//Texel >> SampleLevel as a power of two scale, exact for whole floats
+			const VectorRegister X0 = VectorTruncate(VectorMultiply(SampleX0, Scale));
+			const VectorRegister Y0 = VectorTruncate(VectorMultiply(SampleY0, Scale));
+			const VectorRegister X1 = VectorTruncate(VectorMultiply(SampleX1, Scale));
+			const VectorRegister Y1 = VectorTruncate(VectorMultiply(SampleY1, Scale));
+			const VectorRegister HalfScale = VectorMultiply(Scale, Half);
+			const VectorRegister CenterX = VectorTruncate(VectorMultiply(VectorAdd(SampleX0, SampleX1), HalfScale));
+			const VectorRegister CenterY = VectorTruncate(VectorMultiply(VectorAdd(SampleY0, SampleY1), HalfScale));
+
+			const bool bTiled = Layout.bTiled;
+			const VectorRegister Depth_0 = VectorMin(
+				VectorGatherDepth(HzbBuffer, VectorGetElementIndex(bTiled, Offset, Pitch, X0, Y0)),
+				VectorGatherDepth(HzbBuffer, VectorGetElementIndex(bTiled, Offset, Pitch, X1, Y0)));
+			const VectorRegister Depth_1 = VectorMin(
+				VectorGatherDepth(HzbBuffer, VectorGetElementIndex(bTiled, Offset, Pitch, X0, Y1)),
+				VectorGatherDepth(HzbBuffer, VectorGetElementIndex(bTiled, Offset, Pitch, X1, Y1)));
+			const VectorRegister MinDepth = VectorMin(VectorMin(Depth_0, Depth_1), VectorGatherDepth(HzbBuffer, VectorGetElementIndex(bTiled, Offset, Pitch, CenterX, CenterY)));
+
+			const uint32 LaneMask = (1u << NumLanes) - 1;
+			const uint32 VisibleBits = uint32(VectorMaskBits(VectorCompareLE(MinDepth, MaxZ))) & LaneMask;
+			//Start is a multiple of 32 and Base - Start of 4, the lanes never straddle two words
+			const int32 LocalIndex = Base - Start;
+			OutMask[LocalIndex >> 5] |= VisibleBits << (LocalIndex & 31);
+
+			if (OutCounters) {
+				VectorStoreAligned(Level, SampleLevel);
+				OutCounters[EMobileHzbStatCounter::Tested] += NumLanes;
+				OutCounters[EMobileHzbStatCounter::OcclusionCulled] += NumLanes - FMath::CountBits(VisibleBits);
+				for (int32 Lane = 0; Lane < NumLanes; ++Lane) {
+					++OutCounters[EMobileHzbStatCounter::FirstMipLevel + int32(SampleLevel[Lane])];
+				}
+			}
+		}
+	}
+}
+
+void FMobileHzbSystem::MobileCpuQueryVisibility(const FMobileHzbBufferLayout& Layout, const float* HzbBuffer, const FMobileHzbQueryBatch& Batch, TArray<uint32>& OutVisibilityMask) {
+	SCOPE_CYCLE_COUNTER(STAT_MobileHZB_CPUQuery);
+	const int32 NumBounds = Batch.Num();
+	check(Batch.NDCMinX.Num() == NumBounds && Batch.NDCMinY.Num() == NumBounds && Batch.NDCMaxX.Num() == NumBounds && Batch.NDCMaxY.Num() == NumBounds);
+
+	OutVisibilityMask.Reset();
+	OutVisibilityMask.SetNumZeroed(FMath::DivideAndRoundUp(NumBounds, 32));
+	if (NumBounds == 0) {
+		return;
+	}
+
+	const int32 NumChunks = FMath::DivideAndRoundUp(NumBounds, MobileHzbCpu::kQueryChunkSize);
+	uint32* MaskData = OutVisibilityMask.GetData();
+	const bool bStats = FMobileHzbStats::IsEnabled();
+	ParallelFor(NumChunks, [&Layout, HzbBuffer, &Batch, NumBounds, MaskData, bStats](int32 ChunkIndex) {
+		const int32 Start = ChunkIndex * MobileHzbCpu::kQueryChunkSize;
+		const int32 End = FMath::Min(Start + MobileHzbCpu::kQueryChunkSize, NumBounds);
+		//Chunk local, one atomic per counter per chunk
+		uint32 Counters[EMobileHzbStatCounter::Num] = {};
+		MobileHzbCpu::QueryChunk(Layout, HzbBuffer, Batch, Start, End, MaskData + (Start >> 5), bStats ? Counters : nullptr);
+		if (bStats) {
+			GMobileHzbStats.AddCPUCounters(Counters);
+		}
+	});
+}
+
+void FMobileHzbSystem::MobileCpuQueryVisibility(const FMobileHzbQueryBatch& Batch, TArray<uint32>& OutVisibilityMask) const {
+	check(MobileHZBBuffer_CPU.Num() >= int32(BufferLayout.NumElements));
+	MobileCpuQueryVisibility(BufferLayout, MobileHZBBuffer_CPU.GetData(), Batch, OutVisibilityMask);
+}
+
+FFloat16 FMobileHzbSystem::QuantizeFurthestDepth(const float DeviceZ) {
+	//Toward the far plane (0, inverted Z), whatever rounding FFloat16 uses
+	FFloat16 Half(DeviceZ);
+	while (Half.Encoded > 0 && Half.GetFloat() > DeviceZ) {
+		--Half.Encoded;
+	}
+	return Half;
+}
+
+FFloat16 FMobileHzbSystem::QuantizeClosestDepth(const float DeviceZ) {
+	FFloat16 Half(DeviceZ);
+	while (Half.GetFloat() < DeviceZ) {
+		++Half.Encoded;
+	}
+	return Half;
+}
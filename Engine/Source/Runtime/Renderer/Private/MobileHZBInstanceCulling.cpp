@@ -0,0 +1,256 @@
+#include "MobileHZB.h"
+#include "SceneRendering.h"
+#include "ScenePrivate.h"
+
+static constexpr uint32 kInstanceCullingGroupSize = 64;
+
+TAutoConsoleVariable<int32> CVarMobileHZBTwoPhaseCulling(
+	TEXT("r.GpuDriven.MobileHZB.TwoPhaseCulling"),
+	0,
+	TEXT("0: cull against the last built HZB, 1: draw last frame visible instances, build the HZB from them and re-test the rest"),
+	ECVF_RenderThreadSafe
+);
+
+DECLARE_GPU_STAT(MobileHZBCulling);
+
+class FMobileHZBInstanceCullingInitArgsCS : public FGlobalShader
+{
+	DECLARE_GLOBAL_SHADER(FMobileHZBInstanceCullingInitArgsCS);
+
+public:
+
+	FMobileHZBInstanceCullingInitArgsCS() : FGlobalShader() {}
+
+	FMobileHZBInstanceCullingInitArgsCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+		: FGlobalShader(Initializer) {
+		DrawBatches.Bind(Initializer.ParameterMap, TEXT("DrawBatches"));
+		NumBatches.Bind(Initializer.ParameterMap, TEXT("NumBatches"));
+		DrawIndirectArgsUAV.Bind(Initializer.ParameterMap, TEXT("DrawIndirectArgsUAV"));
+	}
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters) {
+		return FMobileHzbSystem::ShouldCompileBufferShaders(Parameters);
+	}
+
+	static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment) {
+		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+		FMobileHzbSystem::ModifyHzbCompilationEnvironment(OutEnvironment);
+	}
+
+	void BindParameters(FRHICommandList& RHICmdList, FRHIShaderResourceView* DrawBatchesSRV, const uint32 InNumBatches, const FRWBuffer& DrawIndirectArgs) {
+		SetSRVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), DrawBatches, DrawBatchesSRV);
+		SetShaderValue(RHICmdList, RHICmdList.GetBoundComputeShader(), NumBatches, InNumBatches);
+		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), DrawIndirectArgsUAV, DrawIndirectArgs.UAV);
+	}
+
+	void UnBindParameters(FRHICommandList& RHICmdList) {
+		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), DrawIndirectArgsUAV, nullptr);
+	}
+
+private:
+	LAYOUT_FIELD(FShaderResourceParameter, DrawBatches);
+	LAYOUT_FIELD(FShaderParameter, NumBatches);
+	LAYOUT_FIELD(FShaderResourceParameter, DrawIndirectArgsUAV);
+};
+
+class FMobileHZBInstanceCullingCS : public FGlobalShader
+{
+	DECLARE_GLOBAL_SHADER(FMobileHZBInstanceCullingCS);
+
+public:
+	class FCullingPhase : SHADER_PERMUTATION_INT("CULLING_PHASE", 3);
+	class FPackedFP16 : SHADER_PERMUTATION_BOOL("HZB_FP16");
+	class FTiled : SHADER_PERMUTATION_BOOL("HZB_TILED");
+	class FStats : SHADER_PERMUTATION_BOOL("HZB_STATS");
+	using FPermutationDomain = TShaderPermutationDomain<FCullingPhase, FPackedFP16, FTiled, FStats>;
+
+	FMobileHZBInstanceCullingCS() : FGlobalShader() {}
+
+	FMobileHZBInstanceCullingCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+		: FGlobalShader(Initializer) {
+		HZBBuffer.Bind(Initializer.ParameterMap, TEXT("HZBBuffer"));
+		HZBMipLayout.Bind(Initializer.ParameterMap, TEXT("HZBMipLayout"));
+		HZBSize.Bind(Initializer.ParameterMap, TEXT("HZBSize"));
+		InstanceBounds.Bind(Initializer.ParameterMap, TEXT("InstanceBounds"));
+		DrawBatches.Bind(Initializer.ParameterMap, TEXT("DrawBatches"));
+		CullingPreViewTranslation.Bind(Initializer.ParameterMap, TEXT("CullingPreViewTranslation"));
+		CullingTranslatedWorldToClip.Bind(Initializer.ParameterMap, TEXT("CullingTranslatedWorldToClip"));
+		CullingKeepOffscreen.Bind(Initializer.ParameterMap, TEXT("CullingKeepOffscreen"));
+		HZBPreViewTranslation.Bind(Initializer.ParameterMap, TEXT("HZBPreViewTranslation"));
+		HZBTranslatedWorldToClip.Bind(Initializer.ParameterMap, TEXT("HZBTranslatedWorldToClip"));
+		HZBViewMoved.Bind(Initializer.ParameterMap, TEXT("HZBViewMoved"));
+		NumInstances.Bind(Initializer.ParameterMap, TEXT("NumInstances"));
+		DrawIndirectArgsUAV.Bind(Initializer.ParameterMap, TEXT("DrawIndirectArgsUAV"));
+		CulledInstanceIdsUAV.Bind(Initializer.ParameterMap, TEXT("CulledInstanceIdsUAV"));
+		VisibilityBitsUAV.Bind(Initializer.ParameterMap, TEXT("VisibilityBitsUAV"));
+		HZBStatsUAV.Bind(Initializer.ParameterMap, TEXT("HZBStatsUAV"));
+	}
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters) {
+		return FMobileHzbSystem::ShouldCompileBufferShaders(Parameters);
+	}
+
+	static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment) {
+		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+		FMobileHzbSystem::ModifyHzbCompilationEnvironment(OutEnvironment);
+	}
+
+	void BindParameters(FRHICommandList& RHICmdList, const FViewInfo& View, FMobileHzbSystem& HzbSystem, FRHIShaderResourceView* InstanceBoundsSRV, const uint32 InNumInstances, FRHIShaderResourceView* DrawBatchesSRV, const FMobileHzbInstanceCullingResult& Result, FRHIUnorderedAccessView* StatsUAV) {
+		HzbSystem.SetHZBResourcesForShader(RHICmdList, HZBBuffer);
+		HzbSystem.SetHZBLayoutForShader(RHICmdList, HZBMipLayout, HZBSize);
+		SetSRVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), InstanceBounds, InstanceBoundsSRV);
+		SetSRVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), DrawBatches, DrawBatchesSRV);
+		//A light view HZB culls casters in the light space its shadow depth was rendered with
+		SetShaderValue(RHICmdList, RHICmdList.GetBoundComputeShader(), CullingPreViewTranslation, HzbSystem.bLightViewHzb ? FVector::ZeroVector : View.ViewMatrices.GetPreViewTranslation());
+		SetShaderValue(RHICmdList, RHICmdList.GetBoundComputeShader(), CullingTranslatedWorldToClip, HzbSystem.bLightViewHzb ? HzbSystem.LightViewWorldToClip : View.ViewMatrices.GetTranslatedViewProjectionMatrix());
+		SetShaderValue(RHICmdList, RHICmdList.GetBoundComputeShader(), CullingKeepOffscreen, HzbSystem.bLightViewHzb ? 1u : 0u);
+		//Frustum with this frame's camera, occlusion with the one the HZB was built or reprojected for
+		const FViewMatrices& HzbViewMatrices = HzbSystem.GetHzbViewMatrices(View);
+		const bool bHzbViewMoved = !HzbSystem.bLightViewHzb && HzbSystem.IsHzbViewMoved(View);
+		SetShaderValue(RHICmdList, RHICmdList.GetBoundComputeShader(), HZBPreViewTranslation, HzbViewMatrices.GetPreViewTranslation());
+		SetShaderValue(RHICmdList, RHICmdList.GetBoundComputeShader(), HZBTranslatedWorldToClip, HzbViewMatrices.GetTranslatedViewProjectionMatrix());
+		SetShaderValue(RHICmdList, RHICmdList.GetBoundComputeShader(), HZBViewMoved, bHzbViewMoved ? 1u : 0u);
+		SetShaderValue(RHICmdList, RHICmdList.GetBoundComputeShader(), NumInstances, InNumInstances);
+		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), DrawIndirectArgsUAV, Result.DrawIndirectArgs.UAV);
+		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), CulledInstanceIdsUAV, Result.CulledInstanceIds.UAV);
+		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), VisibilityBitsUAV, HzbSystem.InstanceVisibilityBits.UAV);
+		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), HZBStatsUAV, StatsUAV);
+	}
+
+	void UnBindParameters(FRHICommandList& RHICmdList) {
+		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), DrawIndirectArgsUAV, nullptr);
+		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), CulledInstanceIdsUAV, nullptr);
+		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), VisibilityBitsUAV, nullptr);
+		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), HZBStatsUAV, nullptr);
+	}
+
+private:
+	LAYOUT_FIELD(FShaderResourceParameter, HZBBuffer);
+	LAYOUT_FIELD(FShaderParameter, HZBMipLayout);
+	LAYOUT_FIELD(FShaderParameter, HZBSize);
+	LAYOUT_FIELD(FShaderResourceParameter, InstanceBounds);
+	LAYOUT_FIELD(FShaderResourceParameter, DrawBatches);
+	LAYOUT_FIELD(FShaderParameter, CullingPreViewTranslation);
+	LAYOUT_FIELD(FShaderParameter, CullingTranslatedWorldToClip);
+	LAYOUT_FIELD(FShaderParameter, CullingKeepOffscreen);
+	LAYOUT_FIELD(FShaderParameter, HZBPreViewTranslation);
+	LAYOUT_FIELD(FShaderParameter, HZBTranslatedWorldToClip);
+	LAYOUT_FIELD(FShaderParameter, HZBViewMoved);
+	LAYOUT_FIELD(FShaderParameter, NumInstances);
+	LAYOUT_FIELD(FShaderResourceParameter, DrawIndirectArgsUAV);
+	LAYOUT_FIELD(FShaderResourceParameter, CulledInstanceIdsUAV);
+	LAYOUT_FIELD(FShaderResourceParameter, VisibilityBitsUAV);
+	LAYOUT_FIELD(FShaderResourceParameter, HZBStatsUAV);
+};
+
+IMPLEMENT_GLOBAL_SHADER(FMobileHZBInstanceCullingInitArgsCS, "/Engine/Private/MobileHZBInstanceCulling.usf", "HZBInstanceCullingInitArgsCS", SF_Compute);
+IMPLEMENT_GLOBAL_SHADER(FMobileHZBInstanceCullingCS, "/Engine/Private/MobileHZBInstanceCulling.usf", "HZBInstanceCullingCS", SF_Compute);
+
+void FMobileHzbInstanceCullingResult::Initialize(const uint32 NumBatches, const uint32 NumInstances) {
+	//Grow only, the buffers are reused every frame
+	const uint32 NumArgs = FMath::Max(NumBatches, 1u) * kDrawIndirectArgsStride;
+	if (DrawIndirectArgs.NumBytes < NumArgs * sizeof(uint32)) {
+		DrawIndirectArgs.Release();
+		DrawIndirectArgs.Initialize(sizeof(uint32), NumArgs, PF_R32_UINT, BUF_Static | BUF_DrawIndirect, TEXT("MobileHZBDrawIndirectArgs"));
+	}
+
+	const uint32 NumIds = FMath::Max(NumInstances, 1u);
+	if (CulledInstanceIds.NumBytes < NumIds * sizeof(uint32)) {
+		CulledInstanceIds.Release();
+		CulledInstanceIds.Initialize(sizeof(uint32), NumIds, PF_R32_UINT, BUF_Static, TEXT("MobileHZBCulledInstanceIds"));
+	}
+}
+
+void FMobileHzbInstanceCullingResult::Release() {
+	DrawIndirectArgs.Release();
+	CulledInstanceIds.Release();
+}
+
+bool FMobileHzbSystem::IsTwoPhaseCullingEnabled() {
+	return CVarMobileHZBTwoPhaseCulling.GetValueOnRenderThread() != 0;
+}
+
+void FMobileHzbSystem::InitInstanceVisibilityBits(FRHICommandList& RHICmdList, const uint32 NumInstances) {
+	//Grow only, new instances start culled so the re-test phase picks them up
+	const uint32 NumWords = FMath::DivideAndRoundUp(FMath::Max(NumInstances, 1u), 32u);
+	if (InstanceVisibilityBits.NumBytes >= NumWords * sizeof(uint32)) {
+		return;
+	}
+	InstanceVisibilityBits.Release();
+	InstanceVisibilityBits.Initialize(sizeof(uint32), NumWords, PF_R32_UINT, BUF_Static, TEXT("MobileHZBInstanceVisibilityBits"));
+	RHICmdList.Transition(FRHITransitionInfo(InstanceVisibilityBits.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+	RHICmdList.ClearUAVUint(InstanceVisibilityBits.UAV, FUintVector4(0, 0, 0, 0));
+}
+
+void FMobileHzbSystem::MobileCullInstances(FRHICommandList& RHICmdList, const FViewInfo& View, FRHIShaderResourceView* InstanceBoundsSRV, const uint32 NumInstances, FRHIShaderResourceView* DrawBatchesSRV, const uint32 NumBatches, FMobileHzbInstanceCullingResult& OutResult, const EMobileHzbCullingPhase Phase) {
+	checkf(!FMobileHzbSystem::bUseTextureResources, TEXT("Instance culling reads the StorageBuffer HZB"));
+	if (NumBatches == 0) {
+		return;
+	}
+
+	SCOPED_DRAW_EVENTF(RHICmdList, MobileHZBCulling, TEXT("MobileHZBInstanceCulling(phase=%d) %d instances"), static_cast<int32>(Phase), NumInstances);
+	SCOPED_GPU_STAT(RHICmdList, MobileHZBCulling);
+
+	OutResult.Initialize(NumBatches, NumInstances);
+	if (Phase != EMobileHzbCullingPhase::Single) {
+		InitInstanceVisibilityBits(RHICmdList, NumInstances);
+	}
+	RHICmdList.Transition(FRHITransitionInfo(OutResult.DrawIndirectArgs.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+	RHICmdList.Transition(FRHITransitionInfo(OutResult.CulledInstanceIds.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+
+	//Clear InstanceCount
+	{
+		TShaderMapRef<FMobileHZBInstanceCullingInitArgsCS> InitArgsShader(View.ShaderMap);
+		RHICmdList.SetComputeShader(InitArgsShader.GetComputeShader());
+		InitArgsShader->BindParameters(RHICmdList, DrawBatchesSRV, NumBatches, OutResult.DrawIndirectArgs);
+		RHICmdList.DispatchComputeShader(FMath::DivideAndRoundUp(NumBatches, kInstanceCullingGroupSize), 1, 1);
+		InitArgsShader->UnBindParameters(RHICmdList);
+	}
+
+	//Test and compact
+	if (NumInstances > 0) {
+		RHICmdList.Transition(FRHITransitionInfo(OutResult.DrawIndirectArgs.UAV, ERHIAccess::UAVCompute, ERHIAccess::UAVCompute)); //RAW on InstanceCount
+		FRHIUnorderedAccessView* StatsUAV = FMobileHzbStats::IsEnabled() ? GMobileHzbStats.GetGPUCounterUAV(RHICmdList) : nullptr;
+		FMobileHZBInstanceCullingCS::FPermutationDomain PermutationVector;
+		PermutationVector.Set<FMobileHZBInstanceCullingCS::FCullingPhase>(static_cast<int32>(Phase));
+		PermutationVector.Set<FMobileHZBInstanceCullingCS::FPackedFP16>(BufferLayout.bPackedFP16);
+		PermutationVector.Set<FMobileHZBInstanceCullingCS::FTiled>(BufferLayout.bTiled);
+		PermutationVector.Set<FMobileHZBInstanceCullingCS::FStats>(StatsUAV != nullptr);
+		TShaderMapRef<FMobileHZBInstanceCullingCS> CullingShader(View.ShaderMap, PermutationVector);
+		RHICmdList.SetComputeShader(CullingShader.GetComputeShader());
+		CullingShader->BindParameters(RHICmdList, View, *this, InstanceBoundsSRV, NumInstances, DrawBatchesSRV, OutResult, StatsUAV);
+		RHICmdList.DispatchComputeShader(FMath::DivideAndRoundUp(NumInstances, kInstanceCullingGroupSize), 1, 1);
+		CullingShader->UnBindParameters(RHICmdList);
+	}
+
+	if (Phase == EMobileHzbCullingPhase::ReTest) {
+		RHICmdList.Transition(FRHITransitionInfo(InstanceVisibilityBits.UAV, ERHIAccess::UAVCompute, ERHIAccess::UAVCompute)); //Next frame phase 1
+	}
+
+	RHICmdList.Transition(FRHITransitionInfo(OutResult.DrawIndirectArgs.UAV, ERHIAccess::UAVCompute, ERHIAccess::IndirectArgs));
+	RHICmdList.Transition(FRHITransitionInfo(OutResult.CulledInstanceIds.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVGraphics));
+}
+
+bool FMobileHzbSystem::MobileCullAndDrawInstances(FRHICommandListImmediate& RHICmdList, const FViewInfo& View, FRHIShaderResourceView* InstanceBoundsSRV, const uint32 NumInstances, FRHIShaderResourceView* DrawBatchesSRV, const uint32 NumBatches, FMobileHzbInstanceCullingResult& OutResult, TFunctionRef<void(FRHICommandListImmediate&, const FMobileHzbInstanceCullingResult&)> DrawCulled) {
+	const FMobileHzbSystemRef FoundSystem = FMobileHzbSystem::GetHzbSystemByViewStateUniqueId(View.ViewState);
+	if (!FoundSystem) {
+		return false;
+	}
+
+	if (!IsTwoPhaseCullingEnabled()) {
+		FoundSystem->MobileCullInstances(RHICmdList, View, InstanceBoundsSRV, NumInstances, DrawBatchesSRV, NumBatches, OutResult, EMobileHzbCullingPhase::Single);
+		DrawCulled(RHICmdList, OutResult);
+		return true;
+	}
+
+	//Last frame visible set, its depth is the occluders of the re-test
+	FoundSystem->MobileCullInstances(RHICmdList, View, InstanceBoundsSRV, NumInstances, DrawBatchesSRV, NumBatches, OutResult, EMobileHzbCullingPhase::PreviousVisible);
+	DrawCulled(RHICmdList, OutResult);
+
+	FMobileHzbSystem::MobileBuildHzb(RHICmdList, View);
+
+	//Same buffers, the transitions of MobileCullInstances order the re-test after the indirect draws of phase 1
+	FoundSystem->MobileCullInstances(RHICmdList, View, InstanceBoundsSRV, NumInstances, DrawBatchesSRV, NumBatches, OutResult, EMobileHzbCullingPhase::ReTest);
+	DrawCulled(RHICmdList, OutResult);
+	return true;
+}
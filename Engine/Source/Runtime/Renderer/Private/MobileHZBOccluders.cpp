@@ -0,0 +1,292 @@
+#include "MobileHZB.h"
+#include "SceneRendering.h"
+#include "Math/VectorRegister.h"
+#include "Async/ParallelFor.h"
+
+TAutoConsoleVariable<int32> CVarMobileHZBCpuOccluders(
+	TEXT("r.GpuDriven.MobileHZB.CpuOccluders"),
+	0,
+	TEXT("Rasterize the occluder meshes handed to FMobileHzbSystem::SetViewOccluders on the CPU at HZB mip 0 resolution, for scenes without a usable depth prepass.\n")
+	TEXT("1: MobileHZBBuffer_CPU only, same frame CPU queries. 2: also upload it as the StorageBuffer HZB, the SceneDepth build is skipped"),
+	ECVF_RenderThreadSafe
+);
+
+DECLARE_CYCLE_STAT(TEXT("CPU Occluder Raster"), STAT_MobileHZB_CPUOccluderRaster, STATGROUP_MobileHZB);
+DECLARE_DWORD_COUNTER_STAT(TEXT("CPU Occluder Triangles"), STAT_MobileHZB_CPUOccluderTriangles, STATGROUP_MobileHZB);
+
+namespace MobileHzbOccluders
+{
+	//Mip 0 texels, multiple of the 4 wide SIMD span so a row of one tile never crosses into the next
+	static constexpr int32 kBinTileSize = 32;
+	static constexpr int32 kLaneCount = 4;
+
+	//Screen space triangle, Value(X, Y) = A * X + B * Y + C at integer texel coordinates.
+	//Edges are >= 0 only when the whole texel is inside, depth is the furthest (smallest) device Z over the texel
+	struct FTriangleSetup {
+		float EdgeA[3];
+		float EdgeB[3];
+		float EdgeC[3];
+		float DepthA;
+		float DepthB;
+		float DepthC;
+		float MinDepth;
+		FIntPoint TexelMin; //Fully covered texels can only lie inside, inclusive
+		FIntPoint TexelMax;
+	};
+
+	//x right, y down in mip 0 texels, device Z. W < 0 marks a vertex in front of the near plane
+	static FORCEINLINE FVector4 ProjectToHzb(const FMatrix& LocalToClip, const FVector& Position, const FIntPoint MipSize) {
+		const FVector4 Clip = LocalToClip.TransformFVector4(FVector4(Position, 1.f));
+		if (Clip.W <= KINDA_SMALL_NUMBER || Clip.Z > Clip.W) {
+			return FVector4(0.f, 0.f, 0.f, -1.f);
+		}
+		const float InvW = 1.f / Clip.W;
+		return FVector4((Clip.X * InvW * 0.5f + 0.5f) * MipSize.X, (0.5f - Clip.Y * InvW * 0.5f) * MipSize.Y, Clip.Z * InvW, 1.f);
+	}
+
+	static void SetupTriangles(const FMobileHzbOccluder& Occluder, const FMatrix& WorldToClip, const FIntPoint MipSize, TArray<FTriangleSetup>& OutTriangles) {
+		const FMobileHzbOccluderMesh& Mesh = *Occluder.Mesh;
+		const FMatrix LocalToClip = Occluder.LocalToWorld * WorldToClip;
+
+		TArray<FVector4, TInlineAllocator<256>> Projected;
+		Projected.SetNumUninitialized(Mesh.Vertices.Num());
+		for (int32 VertexIndex = 0; VertexIndex < Mesh.Vertices.Num(); ++VertexIndex) {
+			Projected[VertexIndex] = ProjectToHzb(LocalToClip, Mesh.Vertices[VertexIndex], MipSize);
+		}
+
+		for (int32 Index = 0; Index + 2 < Mesh.Indices.Num(); Index += 3) {
+			const FVector4* V0 = &Projected[Mesh.Indices[Index]];
+			const FVector4* V1 = &Projected[Mesh.Indices[Index + 1]];
+			const FVector4* V2 = &Projected[Mesh.Indices[Index + 2]];
+			//No clipping, a dropped triangle only loses occlusion
+			if (V0->W < 0.f || V1->W < 0.f || V2->W < 0.f) {
+				continue;
+			}
+
+			//Twice the area, a triangle under one texel (area 1) can never cover a whole one
+			float Area = (V1->X - V0->X) * (V2->Y - V0->Y) - (V1->Y - V0->Y) * (V2->X - V0->X);
+			if (FMath::Abs(Area) < 2.f) {
+				continue;
+			}
+			//Occluders are closed, either winding is fine
+			if (Area < 0.f) {
+				Swap(V1, V2);
+				Area = -Area;
+			}
+
+			FTriangleSetup Triangle;
+			Triangle.TexelMin = FIntPoint(
+				FMath::Max(FMath::CeilToInt(FMath::Min3(V0->X, V1->X, V2->X)), 0),
+				FMath::Max(FMath::CeilToInt(FMath::Min3(V0->Y, V1->Y, V2->Y)), 0));
+			Triangle.TexelMax = FIntPoint(
+				FMath::Min(FMath::FloorToInt(FMath::Max3(V0->X, V1->X, V2->X)) - 1, MipSize.X - 1),
+				FMath::Min(FMath::FloorToInt(FMath::Max3(V0->Y, V1->Y, V2->Y)) - 1, MipSize.Y - 1));
+			if (Triangle.TexelMin.X > Triangle.TexelMax.X || Triangle.TexelMin.Y > Triangle.TexelMax.Y) {
+				continue;
+			}
+
+			//Edge i is opposite vertex i, positive inside and equal to Area at vertex i
+			const FVector4* Vertices[3] = { V0, V1, V2 };
+			float DepthA = 0.f;
+			float DepthB = 0.f;
+			float DepthC = 0.f;
+			for (int32 EdgeIndex = 0; EdgeIndex < 3; ++EdgeIndex) {
+				const FVector4& EdgeStart = *Vertices[(EdgeIndex + 1) % 3];
+				const FVector4& EdgeEnd = *Vertices[(EdgeIndex + 2) % 3];
+				const float A = EdgeStart.Y - EdgeEnd.Y;
+				const float B = EdgeEnd.X - EdgeStart.X;
+				const float C = -(A * EdgeStart.X + B * EdgeStart.Y);
+				//Texel center, pulled in by the half extent the edge moves over the texel
+				Triangle.EdgeA[EdgeIndex] = A;
+				Triangle.EdgeB[EdgeIndex] = B;
+				Triangle.EdgeC[EdgeIndex] = C + 0.5f * (A + B) - 0.5f * (FMath::Abs(A) + FMath::Abs(B));
+				//Barycentric depth plane
+				DepthA += Vertices[EdgeIndex]->Z * A;
+				DepthB += Vertices[EdgeIndex]->Z * B;
+				DepthC += Vertices[EdgeIndex]->Z * C;
+			}
+
+			//Lowered the same way to its minimum over the texel
+			const float InvArea = 1.f / Area;
+			Triangle.DepthA = DepthA * InvArea;
+			Triangle.DepthB = DepthB * InvArea;
+			Triangle.DepthC = DepthC * InvArea + 0.5f * (Triangle.DepthA + Triangle.DepthB) - 0.5f * (FMath::Abs(Triangle.DepthA) + FMath::Abs(Triangle.DepthB));
+			//The extrapolated plane may drop below the triangle near its corners
+			Triangle.MinDepth = FMath::Min3(V0->Z, V1->Z, V2->Z);
+			OutTriangles.Add(Triangle);
+		}
+	}
+
+	//Keeps the nearest depth of all triangles covering a texel, Depth starts at 0 (furthest)
+	static void RasterizeTile(const TArray<FTriangleSetup>& Triangles, const TArray<int32>& Bin, const FIntPoint TileMin, const int32 Pitch, float* Depth) {
+		const VectorRegister Zero = VectorZero();
+		const VectorRegister LaneStep = VectorSetFloat1(float(kLaneCount));
+		for (const int32 TriangleIndex : Bin) {
+			const FTriangleSetup& Triangle = Triangles[TriangleIndex];
+			//TileMin is a multiple of kLaneCount, the aligned span stays inside the tile
+			const int32 MinX = FMath::Max(Triangle.TexelMin.X, TileMin.X) & ~(kLaneCount - 1);
+			const int32 MaxX = FMath::Min(Triangle.TexelMax.X, TileMin.X + kBinTileSize - 1);
+			const int32 MinY = FMath::Max(Triangle.TexelMin.Y, TileMin.Y);
+			const int32 MaxY = FMath::Min(Triangle.TexelMax.Y, TileMin.Y + kBinTileSize - 1);
+
+			const VectorRegister EdgeA0 = VectorSetFloat1(Triangle.EdgeA[0]);
+			const VectorRegister EdgeA1 = VectorSetFloat1(Triangle.EdgeA[1]);
+			const VectorRegister EdgeA2 = VectorSetFloat1(Triangle.EdgeA[2]);
+			const VectorRegister DepthA = VectorSetFloat1(Triangle.DepthA);
+			const VectorRegister MinDepth = VectorSetFloat1(Triangle.MinDepth);
+			const VectorRegister StartX = MakeVectorRegister(float(MinX), float(MinX + 1), float(MinX + 2), float(MinX + 3));
+
+			for (int32 Y = MinY; Y <= MaxY; ++Y) {
+				//Texels outside the bounds fail the edges, the bounds only skip work
+				const VectorRegister RowEdge0 = VectorSetFloat1(Triangle.EdgeB[0] * Y + Triangle.EdgeC[0]);
+				const VectorRegister RowEdge1 = VectorSetFloat1(Triangle.EdgeB[1] * Y + Triangle.EdgeC[1]);
+				const VectorRegister RowEdge2 = VectorSetFloat1(Triangle.EdgeB[2] * Y + Triangle.EdgeC[2]);
+				const VectorRegister RowDepth = VectorSetFloat1(Triangle.DepthB * Y + Triangle.DepthC);
+				float* DepthRow = Depth + Y * Pitch;
+				VectorRegister TexelX = StartX;
+				for (int32 X = MinX; X <= MaxX; X += kLaneCount, TexelX = VectorAdd(TexelX, LaneStep)) {
+					const VectorRegister Inside = VectorBitwiseAnd(
+						VectorBitwiseAnd(
+							VectorCompareGE(VectorMultiplyAdd(EdgeA0, TexelX, RowEdge0), Zero),
+							VectorCompareGE(VectorMultiplyAdd(EdgeA1, TexelX, RowEdge1), Zero)),
+						VectorCompareGE(VectorMultiplyAdd(EdgeA2, TexelX, RowEdge2), Zero));
+					if (VectorMaskBits(Inside) == 0) {
+						continue;
+					}
+					const VectorRegister TriangleDepth = VectorMax(VectorMultiplyAdd(DepthA, TexelX, RowDepth), MinDepth);
+					const VectorRegister OldDepth = VectorLoad(DepthRow + X);
+					VectorStore(VectorSelect(Inside, VectorMax(OldDepth, TriangleDepth), OldDepth), DepthRow + X);
+				}
+			}
+		}
+	}
+}
+
+void FMobileHzbSystem::MobileCpuRasterizeOccluders(const FMobileHzbBufferLayout& Layout, const FMatrix& WorldToClip, TArrayView<const FMobileHzbOccluder> Occluders, float* OutHzbBuffer) {
+	SCOPE_CYCLE_COUNTER(STAT_MobileHZB_CPUOccluderRaster);
+	using namespace MobileHzbOccluders;
+	check(Layout.NumMips > 0);
+
+	//Transform and setup, one worker per occluder
+	const FIntPoint MipSize = Layout.GetMipSize(0);
+	TArray<TArray<FTriangleSetup>> OccluderTriangles;
+	OccluderTriangles.SetNum(Occluders.Num());
+	ParallelFor(Occluders.Num(), [&Occluders, &WorldToClip, MipSize, &OccluderTriangles](int32 OccluderIndex) {
+		if (Occluders[OccluderIndex].Mesh.IsValid()) {
+			SetupTriangles(Occluders[OccluderIndex], WorldToClip, MipSize, OccluderTriangles[OccluderIndex]);
+		}
+	});
+
+	TArray<FTriangleSetup> Triangles;
+	for (TArray<FTriangleSetup>& Setup : OccluderTriangles) {
+		Triangles.Append(MoveTemp(Setup));
+	}
+	SET_DWORD_STAT(STAT_MobileHZB_CPUOccluderTriangles, Triangles.Num());
+
+	//Bin by screen tile, each tile owns its texels so the raster workers never share one
+	const FIntPoint NumTiles(FMath::DivideAndRoundUp(MipSize.X, kBinTileSize), FMath::DivideAndRoundUp(MipSize.Y, kBinTileSize));
+	TArray<TArray<int32>> Bins;
+	Bins.SetNum(NumTiles.X * NumTiles.Y);
+	for (int32 TriangleIndex = 0; TriangleIndex < Triangles.Num(); ++TriangleIndex) {
+		const FTriangleSetup& Triangle = Triangles[TriangleIndex];
+		for (int32 TileY = Triangle.TexelMin.Y / kBinTileSize; TileY <= Triangle.TexelMax.Y / kBinTileSize; ++TileY) {
+			for (int32 TileX = Triangle.TexelMin.X / kBinTileSize; TileX <= Triangle.TexelMax.X / kBinTileSize; ++TileX) {
+				Bins[TileY * NumTiles.X + TileX].Add(TriangleIndex);
+			}
+		}
+	}
+
+	//Padded to whole tiles so the SIMD span never needs a tail
+	const int32 Pitch = NumTiles.X * kBinTileSize;
+	TArray<float> Depth;
+	Depth.SetNumZeroed(Pitch * NumTiles.Y * kBinTileSize);
+	float* DepthData = Depth.GetData();
+	ParallelFor(Bins.Num(), [&Triangles, &Bins, NumTiles, Pitch, DepthData](int32 TileIndex) {
+		const FIntPoint TileMin((TileIndex % NumTiles.X) * kBinTileSize, (TileIndex / NumTiles.X) * kBinTileSize);
+		RasterizeTile(Triangles, Bins[TileIndex], TileMin, Pitch, DepthData);
+	});
+
+	FMemory::Memzero(OutHzbBuffer, Layout.NumElements * sizeof(float));
+	for (int32 Y = 0; Y < MipSize.Y; ++Y) {
+		for (int32 X = 0; X < MipSize.X; ++X) {
+			OutHzbBuffer[Layout.GetElementIndex(0, X, Y)] = Depth[Y * Pitch + X];
+		}
+	}
+	MobileCpuReduceMips(Layout, OutHzbBuffer, 1);
+}
+
+FGraphEventRef FMobileHzbSystem::MobileCpuRasterizeOccludersAsync(const FMatrix& WorldToClip, TArray<FMobileHzbOccluder>&& Occluders) {
+	//Same array as the CPU build, the last raster or build task must be done before it is resized
+	WaitCpuHzbTask();
+	const FMobileHzbBufferLayout Layout = BufferLayout;
+	MobileHZBBuffer_CPU.SetNumUninitialized(Layout.NumElements);
+
+	CpuHzbTask = FFunctionGraphTask::CreateAndDispatchWhenReady(
+		[Layout, WorldToClip, LocalOccluders = MoveTemp(Occluders), OutHzbBuffer = MobileHZBBuffer_CPU.GetData()]() {
+			MobileCpuRasterizeOccluders(Layout, WorldToClip, LocalOccluders, OutHzbBuffer);
+		},
+		TStatId(), nullptr, ENamedThreads::AnyBackgroundThreadNormalTask);
+	return CpuHzbTask;
+}
+
+void FMobileHzbSystem::SetViewOccluders(const FSceneViewState* ViewState, TArray<FMobileHzbOccluder>&& Occluders) {
+	check(IsInRenderingThread());
+	const FMobileHzbSystemRef FoundSystem = FMobileHzbSystem::GetHzbSystemByViewStateUniqueId(ViewState);
+	if (FoundSystem) {
+		FoundSystem->PendingOccluders = MoveTemp(Occluders);
+	}
+}
+
+FGraphEventRef FMobileHzbSystem::MobileRasterizeOccluders(FRHICommandListImmediate& RHICmdList, const FViewInfo& View, TArray<FMobileHzbOccluder>&& Occluders) {
+	const int32 Mode = CVarMobileHZBCpuOccluders.GetValueOnRenderThread();
+	if (Mode == 0 || FMobileHzbSystem::bUseTextureResources) {
+		return nullptr;
+	}
+
+	const FMobileHzbSystemRef FoundSystem = FMobileHzbSystem::GetHzbSystemByViewStateUniqueId(View.ViewState);
+	if (!FoundSystem) {
+		return nullptr;
+	}
+	//Layout of this frame, the SceneDepth build may never run in mode 2
+	FoundSystem->InitGPUResources(View);
+
+	FGraphEventRef RasterEvent = FoundSystem->MobileCpuRasterizeOccludersAsync(View.ViewMatrices.GetViewProjectionMatrix(), MoveTemp(Occluders));
+	if (Mode >= 2) {
+		FoundSystem->UploadCpuHzb(RHICmdList);
+		FoundSystem->HzbViewMatrices = View.ViewMatrices;
+		FoundSystem->bHzbViewMatricesValid = true;
+		//Mip 0 no longer holds SceneDepth, the next build has to be a full one
+		FoundSystem->bTemporalHistoryValid = false;
+		FoundSystem->CpuOccluderUploadFrame = GFrameNumberRenderThread;
+	}
+	return RasterEvent;
+}
+
+void FMobileHzbSystem::UploadCpuHzb(FRHICommandListImmediate& RHICmdList) {
+	WaitCpuHzbTask();
+	check(MobileHZBBuffer_CPU.Num() >= int32(BufferLayout.NumElements) && MobileHZBPooledBuffer.IsValid());
+	const FMobileHzbBufferLayout& Layout = BufferLayout;
+	const uint32 ElementBytes = Layout.GetElementBytes();
+	FRHIStructuredBuffer* HzbBuffer = MobileHZBPooledBuffer->GetStructuredBufferRHI();
+	void* Data = RHICmdList.LockStructuredBuffer(HzbBuffer, BufferBaseOffset * ElementBytes, Layout.GetTotalElements() * ElementBytes, RLM_WriteOnly);
+
+	//Closest plane at the near plane never early accepts, the furthest test alone decides
+	if (Layout.bPackedFP16) {
+		FFloat16* HalfData = static_cast<FFloat16*>(Data);
+		for (uint32 Index = 0; Index < Layout.NumElements; ++Index) {
+			HalfData[Index] = QuantizeFurthestDepth(MobileHZBBuffer_CPU[Index]);
+		}
+		const FFloat16 NearPlane = QuantizeClosestDepth(1.f);
+		for (uint32 Index = 0; Index < Layout.ClosestPlaneOffset; ++Index) {
+			HalfData[Layout.NumElements + Index] = NearPlane;
+		}
+	}
+	else {
+		float* FloatData = static_cast<float*>(Data);
+		FMemory::Memcpy(FloatData, MobileHZBBuffer_CPU.GetData(), Layout.NumElements * sizeof(float));
+		for (uint32 Index = 0; Index < Layout.ClosestPlaneOffset; ++Index) {
+			FloatData[Layout.NumElements + Index] = 1.f;
+		}
+	}
+	RHICmdList.UnlockStructuredBuffer(HzbBuffer);
+}
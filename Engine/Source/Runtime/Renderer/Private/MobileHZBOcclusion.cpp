@@ -0,0 +1,106 @@
+#include "MobileHZB.h"
+#include "SceneRendering.h"
+#include "ScenePrivate.h"
+
+static constexpr uint32 kOcclusionQueryGroupSize = 64;
+
+DECLARE_GPU_STAT(MobileHZBOcclusionQuery);
+
+class FMobileHZBTestCS : public FGlobalShader
+{
+	DECLARE_GLOBAL_SHADER(FMobileHZBTestCS);
+
+public:
+	class FPackedFP16 : SHADER_PERMUTATION_BOOL("HZB_FP16");
+	class FTiled : SHADER_PERMUTATION_BOOL("HZB_TILED");
+	using FPermutationDomain = TShaderPermutationDomain<FPackedFP16, FTiled>;
+
+	FMobileHZBTestCS() : FGlobalShader() {}
+
+	FMobileHZBTestCS(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+		: FGlobalShader(Initializer) {
+		HZBBuffer.Bind(Initializer.ParameterMap, TEXT("HZBBuffer"));
+		HZBMipLayout.Bind(Initializer.ParameterMap, TEXT("HZBMipLayout"));
+		HZBSize.Bind(Initializer.ParameterMap, TEXT("HZBSize"));
+		QueryBounds.Bind(Initializer.ParameterMap, TEXT("QueryBounds"));
+		QueryPreViewTranslation.Bind(Initializer.ParameterMap, TEXT("QueryPreViewTranslation"));
+		QueryTranslatedWorldToClip.Bind(Initializer.ParameterMap, TEXT("QueryTranslatedWorldToClip"));
+		HZBPreViewTranslation.Bind(Initializer.ParameterMap, TEXT("HZBPreViewTranslation"));
+		HZBTranslatedWorldToClip.Bind(Initializer.ParameterMap, TEXT("HZBTranslatedWorldToClip"));
+		HZBViewMoved.Bind(Initializer.ParameterMap, TEXT("HZBViewMoved"));
+		NumQueryBounds.Bind(Initializer.ParameterMap, TEXT("NumQueryBounds"));
+		VisibilityBitsUAV.Bind(Initializer.ParameterMap, TEXT("VisibilityBitsUAV"));
+	}
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters) {
+		return FMobileHzbSystem::ShouldCompileBufferShaders(Parameters);
+	}
+
+	static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment) {
+		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+		FMobileHzbSystem::ModifyHzbCompilationEnvironment(OutEnvironment);
+	}
+
+	void BindParameters(FRHICommandList& RHICmdList, const FViewInfo& View, FMobileHzbSystem& HzbSystem, FRHIShaderResourceView* BoundsSRV, const uint32 InNumBounds, const FRWBuffer& OutVisibilityBits) {
+		HzbSystem.SetHZBResourcesForShader(RHICmdList, HZBBuffer);
+		HzbSystem.SetHZBLayoutForShader(RHICmdList, HZBMipLayout, HZBSize);
+		SetSRVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), QueryBounds, BoundsSRV);
+		SetShaderValue(RHICmdList, RHICmdList.GetBoundComputeShader(), QueryPreViewTranslation, View.ViewMatrices.GetPreViewTranslation());
+		SetShaderValue(RHICmdList, RHICmdList.GetBoundComputeShader(), QueryTranslatedWorldToClip, View.ViewMatrices.GetTranslatedViewProjectionMatrix());
+		//Last frame's HZB, the bounds are tested where its camera saw them
+		const FViewMatrices& HzbViewMatrices = HzbSystem.GetHzbViewMatrices(View);
+		SetShaderValue(RHICmdList, RHICmdList.GetBoundComputeShader(), HZBPreViewTranslation, HzbViewMatrices.GetPreViewTranslation());
+		SetShaderValue(RHICmdList, RHICmdList.GetBoundComputeShader(), HZBTranslatedWorldToClip, HzbViewMatrices.GetTranslatedViewProjectionMatrix());
+		SetShaderValue(RHICmdList, RHICmdList.GetBoundComputeShader(), HZBViewMoved, HzbSystem.IsHzbViewMoved(View) ? 1u : 0u);
+		SetShaderValue(RHICmdList, RHICmdList.GetBoundComputeShader(), NumQueryBounds, InNumBounds);
+		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), VisibilityBitsUAV, OutVisibilityBits.UAV);
+	}
+
+	void UnBindParameters(FRHICommandList& RHICmdList) {
+		SetUAVParameter(RHICmdList, RHICmdList.GetBoundComputeShader(), VisibilityBitsUAV, nullptr);
+	}
+
+private:
+	LAYOUT_FIELD(FShaderResourceParameter, HZBBuffer);
+	LAYOUT_FIELD(FShaderParameter, HZBMipLayout);
+	LAYOUT_FIELD(FShaderParameter, HZBSize);
+	LAYOUT_FIELD(FShaderResourceParameter, QueryBounds);
+	LAYOUT_FIELD(FShaderParameter, QueryPreViewTranslation);
+	LAYOUT_FIELD(FShaderParameter, QueryTranslatedWorldToClip);
+	LAYOUT_FIELD(FShaderParameter, HZBPreViewTranslation);
+	LAYOUT_FIELD(FShaderParameter, HZBTranslatedWorldToClip);
+	LAYOUT_FIELD(FShaderParameter, HZBViewMoved);
+	LAYOUT_FIELD(FShaderParameter, NumQueryBounds);
+	LAYOUT_FIELD(FShaderResourceParameter, VisibilityBitsUAV);
+};
+
+IMPLEMENT_GLOBAL_SHADER(FMobileHZBTestCS, "/Engine/Private/MobileHZBOcclusion.usf", "HZBTestCS", SF_Compute);
+
+void FMobileHzbSystem::MobileGpuQueryVisibility(FRHICommandList& RHICmdList, const FViewInfo& View, FRHIShaderResourceView* BoundsSRV, const uint32 NumBounds, FRWBuffer& OutVisibilityBits) {
+	checkf(!FMobileHzbSystem::bUseTextureResources, TEXT("HZBTestCS reads the StorageBuffer HZB, the texture HZB keeps HZBTestPS"));
+	if (NumBounds == 0) {
+		return;
+	}
+
+	SCOPED_DRAW_EVENTF(RHICmdList, MobileHZBOcclusionQuery, TEXT("MobileHZBOcclusionQuery %d bounds"), NumBounds);
+	SCOPED_GPU_STAT(RHICmdList, MobileHZBOcclusionQuery);
+
+	//Grow only, every word is rewritten so no clear is needed
+	const uint32 NumWords = FMath::DivideAndRoundUp(NumBounds, 32u);
+	if (OutVisibilityBits.NumBytes < NumWords * sizeof(uint32)) {
+		OutVisibilityBits.Release();
+		OutVisibilityBits.Initialize(sizeof(uint32), NumWords, PF_R32_UINT, BUF_Static, TEXT("MobileHZBQueryVisibilityBits"));
+	}
+	RHICmdList.Transition(FRHITransitionInfo(OutVisibilityBits.UAV, ERHIAccess::Unknown, ERHIAccess::UAVCompute));
+
+	FMobileHZBTestCS::FPermutationDomain PermutationVector;
+	PermutationVector.Set<FMobileHZBTestCS::FPackedFP16>(BufferLayout.bPackedFP16);
+	PermutationVector.Set<FMobileHZBTestCS::FTiled>(BufferLayout.bTiled);
+	TShaderMapRef<FMobileHZBTestCS> TestShader(View.ShaderMap, PermutationVector);
+	RHICmdList.SetComputeShader(TestShader.GetComputeShader());
+	TestShader->BindParameters(RHICmdList, View, *this, BoundsSRV, NumBounds, OutVisibilityBits);
+	RHICmdList.DispatchComputeShader(FMath::DivideAndRoundUp(NumBounds, kOcclusionQueryGroupSize), 1, 1);
+	TestShader->UnBindParameters(RHICmdList);
+
+	RHICmdList.Transition(FRHITransitionInfo(OutVisibilityBits.UAV, ERHIAccess::UAVCompute, ERHIAccess::SRVCompute));
+}
@@ -0,0 +1,166 @@
+#include "MobileHZB.h"
+#include "SceneRendering.h"
+#include "RenderGraphResourcePool.h"
+
+TAutoConsoleVariable<int32> CVarMobileHZBPoolReleaseFrames(
+	TEXT("r.GpuDriven.MobileHZB.PoolReleaseFrames"),
+	30,
+	TEXT("Frames a view may skip rendering before its HZB storage goes back to the pool, and frames a free pooled buffer is kept before it is destroyed"),
+	ECVF_RenderThreadSafe
+);
+
+TGlobalResource<FMobileHzbBufferPool> GMobileHzbBufferPool;
+
+void FMobileHzbSystemRegistry::Register(const uint32 SceneViewStateUniqueID) {
+	FWriteScopeLock WriteLock(Lock);
+	check(!ViewIdToSlot.Contains(SceneViewStateUniqueID));
+	ViewIdToSlot.Emplace(SceneViewStateUniqueID, Slots.Add(MakeShared<FMobileHzbSystem, ESPMode::ThreadSafe>()));
+}
+
+void FMobileHzbSystemRegistry::Unregister(const uint32 SceneViewStateUniqueID) {
+	FMobileHzbSystemRef RemovedSystem;
+	{
+		FWriteScopeLock WriteLock(Lock);
+		int32 SlotIndex = INDEX_NONE;
+		const bool bFound = ViewIdToSlot.RemoveAndCopyValue(SceneViewStateUniqueID, SlotIndex);
+		check(bFound);
+		RemovedSystem = MoveTemp(Slots[SlotIndex]);
+		Slots.RemoveAt(SlotIndex);
+	}
+	//Destroyed outside the lock, unless a Find caller still holds it
+}
+
+FMobileHzbSystemRef FMobileHzbSystemRegistry::Find(const uint32 SceneViewStateUniqueID) const {
+	FReadScopeLock ReadLock(Lock);
+	const int32* SlotIndex = ViewIdToSlot.Find(SceneViewStateUniqueID);
+	return SlotIndex ? Slots[*SlotIndex] : FMobileHzbSystemRef();
+}
+
+FMobileHzbBufferPool::FEntry* FMobileHzbBufferPool::FindEntry(const FRDGPooledBuffer* PooledBuffer) {
+	for (TArray<FEntry>& Bucket : Buckets) {
+		for (FEntry& Entry : Bucket) {
+			if (Entry.PooledBuffer == PooledBuffer) {
+				return &Entry;
+			}
+		}
+	}
+	return nullptr;
+}
+
+TRefCountPtr<FRDGPooledBuffer> FMobileHzbBufferPool::Acquire(const uint32 NumElements, const uint32 FrameNumber, FShaderResourceViewRHIRef& OutSRV) {
+	const int32 BucketIndex = FMath::CeilLogTwo(FMath::Max(NumElements, 1u));
+	check(BucketIndex < kNumBuckets);
+
+	for (FEntry& Entry : Buckets[BucketIndex]) {
+		if (Entry.NumOwners == 0) {
+			Entry.NumOwners = 1;
+			OutSRV = Entry.SRV;
+			return Entry.PooledBuffer;
+		}
+	}
+
+	FEntry& NewEntry = Buckets[BucketIndex].AddDefaulted_GetRef();
+	//RDG owns the state, the first graph using it transitions from Unknown and extracts it to SRVCompute
+	NewEntry.PooledBuffer = GRenderGraphResourcePool.FindFreeBuffer(FRHICommandListExecutor::GetImmediateCommandList(), FRDGBufferDesc::CreateStructuredDesc(sizeof(float), 1u << BucketIndex), TEXT("MobileHZBBuffer"));
+	NewEntry.SRV = RHICreateShaderResourceView(NewEntry.PooledBuffer->GetStructuredBufferRHI());
+	NewEntry.NumOwners = 1;
+	NewEntry.FreedFrame = FrameNumber;
+	OutSRV = NewEntry.SRV;
+	return NewEntry.PooledBuffer;
+}
+
+void FMobileHzbBufferPool::AddOwner(const FRDGPooledBuffer* PooledBuffer) {
+	FEntry* Entry = FindEntry(PooledBuffer);
+	check(Entry && Entry->NumOwners > 0);
+	++Entry->NumOwners;
+}
+
+void FMobileHzbBufferPool::Release(const FRDGPooledBuffer* PooledBuffer, const uint32 FrameNumber) {
+	FEntry* Entry = FindEntry(PooledBuffer);
+	if (!Entry) {
+		return;
+	}
+	check(Entry->NumOwners > 0);
+	if (--Entry->NumOwners == 0) {
+		Entry->FreedFrame = FrameNumber;
+	}
+}
+
+bool FMobileHzbBufferPool::BeginFrame(const uint32 FrameNumber) {
+	if (LastTickFrame == FrameNumber) {
+		return false;
+	}
+	LastTickFrame = FrameNumber;
+	return true;
+}
+
+void FMobileHzbBufferPool::Tick(const uint32 FrameNumber, const uint32 ReleaseFrames) {
+	for (TArray<FEntry>& Bucket : Buckets) {
+		for (int32 EntryIndex = Bucket.Num() - 1; EntryIndex >= 0; --EntryIndex) {
+			FEntry& Entry = Bucket[EntryIndex];
+			if (Entry.NumOwners == 0 && FrameNumber - Entry.FreedFrame > ReleaseFrames) {
+				//Commands already recorded hold their own RHI references, RDG recycles the buffer once nothing else does
+				Entry.SRV.SafeRelease();
+				Entry.PooledBuffer.SafeRelease();
+				Bucket.RemoveAtSwap(EntryIndex);
+			}
+		}
+	}
+}
+
+uint64 FMobileHzbBufferPool::GetAllocatedBytes() const {
+	uint64 AllocatedBytes = 0;
+	for (const TArray<FEntry>& Bucket : Buckets) {
+		for (const FEntry& Entry : Bucket) {
+			AllocatedBytes += Entry.PooledBuffer->Desc.GetTotalNumBytes();
+		}
+	}
+	return AllocatedBytes;
+}
+
+void FMobileHzbBufferPool::ReleaseDynamicRHI() {
+	for (TArray<FEntry>& Bucket : Buckets) {
+		for (FEntry& Entry : Bucket) {
+			Entry.SRV.SafeRelease();
+			Entry.PooledBuffer.SafeRelease();
+		}
+		Bucket.Empty();
+	}
+}
+
+void FMobileHzbSystem::TickResourcePool(const uint32 FrameNumber) {
+	//Several views build per frame, the first one ticks
+	if (!GMobileHzbBufferPool.BeginFrame(FrameNumber)) {
+		return;
+	}
+
+	const uint32 ReleaseFrames = FMath::Max(CVarMobileHZBPoolReleaseFrames.GetValueOnRenderThread(), 1);
+	SystemRegistry.ForEach([FrameNumber, ReleaseFrames](FMobileHzbSystem& System) {
+		if (FrameNumber - System.LastRenderFrame > ReleaseFrames) {
+			System.ReleaseIdleResources();
+		}
+	});
+	GMobileHzbBufferPool.Tick(FrameNumber, ReleaseFrames);
+}
+
+void FMobileHzbSystem::ReleaseIdleResources() {
+	//InitGPUResources recreates everything the next time the view renders
+	ReleaseHzbBuffer();
+	if (MobileHZBTexture.IsValid()) {
+		MobileHZBTexture.SafeRelease();
+		HzbSize = FIntPoint::ZeroValue;
+	}
+	ShadowCascadeHzbs.Empty();
+	ReadbackRing.Empty();
+	ReadbackWriteIndex = 0;
+	bHzbViewMatricesValid = false;
+}
+
+void FMobileHzbSystem::ReleaseHzbBuffer() {
+	if (MobileHZBPooledBuffer.IsValid()) {
+		GMobileHzbBufferPool.Release(MobileHZBPooledBuffer, GFrameNumberRenderThread);
+	}
+	MobileHZBBufferSRV.SafeRelease();
+	MobileHZBPooledBuffer.SafeRelease();
+	BufferBaseOffset = 0;
+}
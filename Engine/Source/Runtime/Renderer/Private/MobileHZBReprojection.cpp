@@ -0,0 +1,169 @@
+#include "MobileHZB.h"
+#include "SceneRendering.h"
+#include "ScenePrivate.h"
+
+static constexpr int32 kReprojectionGroupSize = 8;
+
+TAutoConsoleVariable<int32> CVarMobileHZBReproject(
+	TEXT("r.GpuDriven.MobileHZB.Reproject"),
+	0,
+	TEXT("Reproject last frame StorageBuffer HZB to the current camera before culling"),
+	ECVF_RenderThreadSafe
+);
+
+DECLARE_GPU_STAT(MobileHZBReprojection);
+
+//HZBMipLayout/HZBSize of IsVisibleHZBStorageBufferDownSampleUnreal4, mip layouts already offset to this view
+BEGIN_SHADER_PARAMETER_STRUCT(FMobileHzbReprojectionLayoutParameters, )
+	SHADER_PARAMETER_ARRAY(FUintVector4, HZBMipLayout, [FMobileHzbBufferLayout::kMaxMipCount])
+	SHADER_PARAMETER(FUintVector4, HZBSize)
+END_SHADER_PARAMETER_STRUCT()
+
+static void SetHzbReprojectionLayoutParameters(FMobileHzbReprojectionLayoutParameters& OutParameters, const FMobileHzbBufferLayout& Layout, const uint32 BaseOffset) {
+	FUintVector4 MipLayout[FMobileHzbBufferLayout::kMaxMipCount];
+	Layout.GetShaderMipLayout(MipLayout, BaseOffset);
+	for (int32 MipLevel = 0; MipLevel < FMobileHzbBufferLayout::kMaxMipCount; ++MipLevel) {
+		OutParameters.HZBMipLayout[MipLevel] = MipLayout[MipLevel];
+	}
+	OutParameters.HZBSize = FUintVector4(Layout.HzbSize.X, Layout.HzbSize.Y, Layout.NumMips, 0);
+}
+
+class FMobileHZBReprojectScatterCS : public FGlobalShader
+{
+	DECLARE_GLOBAL_SHADER(FMobileHZBReprojectScatterCS);
+	SHADER_USE_PARAMETER_STRUCT(FMobileHZBReprojectScatterCS, FGlobalShader)
+
+public:
+	class FPackedFP16 : SHADER_PERMUTATION_BOOL("HZB_FP16");
+	class FTiled : SHADER_PERMUTATION_BOOL("HZB_TILED");
+	using FPermutationDomain = TShaderPermutationDomain<FPackedFP16, FTiled>;
+
+	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
+		SHADER_PARAMETER_STRUCT_INCLUDE(FMobileHzbReprojectionLayoutParameters, Layout)
+		SHADER_PARAMETER(FMatrix, PrevClipToClip)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<float>, PrevHZBBuffer)
+		SHADER_PARAMETER_RDG_BUFFER_UAV(RWBuffer<uint>, ReprojectedDepthUAV)
+	END_SHADER_PARAMETER_STRUCT()
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters) {
+		return FMobileHzbSystem::ShouldCompileBufferShaders(Parameters);
+	}
+
+	static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment) {
+		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+		FMobileHzbSystem::ModifyHzbCompilationEnvironment(OutEnvironment);
+	}
+};
+
+class FMobileHZBReprojectResolveCS : public FGlobalShader
+{
+	DECLARE_GLOBAL_SHADER(FMobileHZBReprojectResolveCS);
+	SHADER_USE_PARAMETER_STRUCT(FMobileHZBReprojectResolveCS, FGlobalShader)
+
+public:
+	class FPackedFP16 : SHADER_PERMUTATION_BOOL("HZB_FP16");
+	class FTiled : SHADER_PERMUTATION_BOOL("HZB_TILED");
+	using FPermutationDomain = TShaderPermutationDomain<FPackedFP16, FTiled>;
+
+	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
+		SHADER_PARAMETER_STRUCT_INCLUDE(FMobileHzbReprojectionLayoutParameters, Layout)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(Buffer<uint>, ReprojectedDepth)
+		SHADER_PARAMETER_RDG_BUFFER_UAV(RWStructuredBuffer<float>, HzbStructuredBufferUAV_Zero)
+	END_SHADER_PARAMETER_STRUCT()
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters) {
+		return FMobileHzbSystem::ShouldCompileBufferShaders(Parameters);
+	}
+
+	static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment) {
+		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+		FMobileHzbSystem::ModifyHzbCompilationEnvironment(OutEnvironment);
+	}
+};
+
+IMPLEMENT_GLOBAL_SHADER(FMobileHZBReprojectScatterCS, "/Engine/Private/MobileHZBReprojection.usf", "HZBReprojectScatterCS", SF_Compute);
+IMPLEMENT_GLOBAL_SHADER(FMobileHZBReprojectResolveCS, "/Engine/Private/MobileHZBReprojection.usf", "HZBReprojectResolveCS", SF_Compute);
+
+void FMobileHzbSystem::MobileReprojectHzb(FRDGBuilder& GraphBuilder, const FViewInfo& View) {
+	if (CVarMobileHZBReproject.GetValueOnRenderThread() == 0) {
+		return;
+	}
+
+	const FMobileHzbSystemRef FoundSystem = FMobileHzbSystem::GetHzbSystemByViewStateUniqueId(View.ViewState);
+	if (FoundSystem && !FMobileHzbSystem::bUseTextureResources && FoundSystem->bHzbViewMatricesValid) {
+		FoundSystem->AddReprojectBufferHZBPasses(GraphBuilder, View);
+	}
+}
+
+void FMobileHzbSystem::AddReprojectBufferHZBPasses(FRDGBuilder& GraphBuilder, const FViewInfo& View) {
+	//Only our own matrices are needed, the HZB may be several frames old when the build was skipped.
+	//No AA projections, the TAA jitter of the two frames would move every splat by a fraction of a texel
+	const FViewMatrices& PrevMatrices = HzbViewMatrices;
+	const FViewMatrices& CurMatrices = View.ViewMatrices;
+	const FMatrix PrevClipToClip =
+		PrevMatrices.ComputeInvProjectionNoAAMatrix() *
+		PrevMatrices.GetInvTranslatedViewMatrix() *
+		FTranslationMatrix(CurMatrices.GetPreViewTranslation() - PrevMatrices.GetPreViewTranslation()) *
+		CurMatrices.GetTranslatedViewMatrix() *
+		CurMatrices.ComputeProjectionNoAAMatrix();
+
+	const FIntPoint MipZeroSize = BufferLayout.GetMipSize(0);
+	const uint32 NumTexels = MipZeroSize.X * MipZeroSize.Y;
+	const int32 DispatchX = FMath::DivideAndRoundUp(MipZeroSize.X, kReprojectionGroupSize);
+	const int32 DispatchY = FMath::DivideAndRoundUp(MipZeroSize.Y, kReprojectionGroupSize);
+
+	RDG_EVENT_SCOPE(GraphBuilder, "MobileHZBReprojection %dx%d", MipZeroSize.X, MipZeroSize.Y);
+	RDG_GPU_STAT_SCOPE(GraphBuilder, MobileHZBReprojection);
+	FRDGBufferRef HzbBuffer = GraphBuilder.RegisterExternalBuffer(MobileHZBPooledBuffer, TEXT("MobileHZBBuffer"));
+	//Transient, asuint(DeviceZ) of mip 0
+	FRDGBufferRef ReprojectedDepth = GraphBuilder.CreateBuffer(FRDGBufferDesc::CreateBufferDesc(sizeof(uint32), NumTexels), TEXT("MobileHZBReprojectedDepth"));
+	FRDGBufferUAVRef ReprojectedDepthUAV = GraphBuilder.CreateUAV(ReprojectedDepth, PF_R32_UINT);
+
+	//Scatter, every texel starts unknown
+	{
+		AddClearUAVPass(GraphBuilder, ReprojectedDepthUAV, MAX_uint32);
+		FMobileHZBReprojectScatterCS::FPermutationDomain PermutationVector;
+		PermutationVector.Set<FMobileHZBReprojectScatterCS::FPackedFP16>(BufferLayout.bPackedFP16);
+		PermutationVector.Set<FMobileHZBReprojectScatterCS::FTiled>(BufferLayout.bTiled);
+		TShaderMapRef<FMobileHZBReprojectScatterCS> ScatterShader(View.ShaderMap, PermutationVector);
+		FMobileHZBReprojectScatterCS::FParameters* PassParameters = GraphBuilder.AllocParameters<FMobileHZBReprojectScatterCS::FParameters>();
+		SetHzbReprojectionLayoutParameters(PassParameters->Layout, BufferLayout, BufferBaseOffset);
+		PassParameters->PrevClipToClip = PrevClipToClip;
+		PassParameters->PrevHZBBuffer = GraphBuilder.CreateSRV(HzbBuffer);
+		PassParameters->ReprojectedDepthUAV = ReprojectedDepthUAV;
+		FComputeShaderUtils::AddPass(
+			GraphBuilder,
+			RDG_EVENT_NAME("MobileHZBReprojectScatter"),
+			ScatterShader,
+			PassParameters,
+			FIntVector(DispatchX, DispatchY, 1));
+	}
+
+	//Resolve into mip 0, then rebuild the chain
+	{
+		FMobileHZBReprojectResolveCS::FPermutationDomain PermutationVector;
+		PermutationVector.Set<FMobileHZBReprojectResolveCS::FPackedFP16>(BufferLayout.bPackedFP16);
+		PermutationVector.Set<FMobileHZBReprojectResolveCS::FTiled>(BufferLayout.bTiled);
+		TShaderMapRef<FMobileHZBReprojectResolveCS> ResolveShader(View.ShaderMap, PermutationVector);
+		FMobileHZBReprojectResolveCS::FParameters* PassParameters = GraphBuilder.AllocParameters<FMobileHZBReprojectResolveCS::FParameters>();
+		SetHzbReprojectionLayoutParameters(PassParameters->Layout, BufferLayout, BufferBaseOffset);
+		PassParameters->ReprojectedDepth = GraphBuilder.CreateSRV(ReprojectedDepth, PF_R32_UINT);
+		PassParameters->HzbStructuredBufferUAV_Zero = GraphBuilder.CreateUAV(HzbBuffer);
+		//One thread per x pair of texels
+		FComputeShaderUtils::AddPass(
+			GraphBuilder,
+			RDG_EVENT_NAME("MobileHZBReprojectResolve"),
+			ResolveShader,
+			PassParameters,
+			FIntVector(FMath::DivideAndRoundUp(MipZeroSize.X, 2 * kReprojectionGroupSize), DispatchY, 1));
+	}
+
+	FMobileHzbBuildViews BuildViews;
+	BuildViews.Add(BufferBaseOffset, FVector4(0.f, 0.f, 0.f, 0.f));
+	AddReduceBufferMipsPasses(GraphBuilder, View.ShaderMap, View.GetShaderPlatform(), HzbBuffer, 1, BuildViews, FIntRect(FIntPoint::ZeroValue, BufferLayout.HzbSize));
+	GraphBuilder.QueueBufferExtraction(HzbBuffer, &MobileHZBPooledBuffer, ERHIAccess::SRVCompute);
+
+	HzbViewMatrices = CurMatrices;
+	//Mip 0 is no longer the depth of a build, temporal reuse has to start over
+	bTemporalHistoryValid = false;
+}
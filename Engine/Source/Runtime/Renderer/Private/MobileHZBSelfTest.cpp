@@ -0,0 +1,677 @@
+#include "MobileHZB.h"
+#include "RendererModule.h"
+#include "Math/RandomStream.h"
+#include "Misc/App.h"
+#include "Misc/AutomationTest.h"
+#include "RenderTargetPool.h"
+#include "GlobalShader.h"
+
+#if !(UE_BUILD_SHIPPING || UE_BUILD_TEST)
+
+TAutoConsoleVariable<int32> CVarMobileHZBValidateReadback(
+	TEXT("r.GpuDriven.MobileHZB.ValidateReadback"),
+	0,
+	TEXT("Rebuild the mips above r.GpuDriven.MobileHZB.ReadbackFirstMip of every new readback on the CPU and warn when the GPU build path disagrees.\n")
+	TEXT("Needs r.GpuDriven.MobileHZB.ReadbackDepth > 0"),
+	ECVF_RenderThreadSafe
+);
+
+void FMobileHzbSystem::ValidateLatestReadback() {
+	if (CVarMobileHZBValidateReadback.GetValueOnRenderThread() == 0 || LatestReadback.HzbBuffer.Num() == 0 || LatestReadback.FrameNumber == ValidatedReadbackFrame) {
+		return;
+	}
+	ValidatedReadbackFrame = LatestReadback.FrameNumber;
+
+	const FMobileHzbBufferLayout& Layout = LatestReadback.Layout;
+	const int32 NumMismatches = CountReduceMismatches(Layout, LatestReadback.HzbBuffer.GetData(), LatestReadback.FirstMipLevel);
+	if (NumMismatches > 0) {
+		UE_LOG(LogRenderer, Warning, TEXT("MobileHZB %s %dx%d%s%s frame %u: %d texels above mip %d differ from the CPU reduction"),
+			FMobileHzbSystem::bUseTextureResources ? TEXT("Texture") : TEXT("StorageBuffer"),
+			Layout.HzbSize.X, Layout.HzbSize.Y,
+			Layout.bPackedFP16 ? TEXT(" FP16") : TEXT(""),
+			Layout.bTiled ? TEXT(" Tiled4x4") : TEXT(""),
+			LatestReadback.FrameNumber, NumMismatches, LatestReadback.FirstMipLevel);
+	}
+}
+
+BEGIN_SHADER_PARAMETER_STRUCT(FMobileHzbTestReadbackParameters, )
+	RDG_BUFFER_ACCESS(HzbBuffer, ERHIAccess::CopySrc)
+END_SHADER_PARAMETER_STRUCT()
+
+void FMobileHzbSystem::BuildAndReadbackTestHzb(FRHICommandListImmediate& RHICmdList, const FMobileHzbBufferLayout& Layout, const TArray<float>& SceneDepth, const FIntPoint SceneDepthSize, TArray<float>& OutHzbBuffer) {
+	check(IsInRenderingThread());
+	//Depth in every channel, the SceneDepth permutation gathers red and the SceneColor one alpha
+	TArray<FLinearColor> Texels;
+	Texels.Reserve(SceneDepth.Num());
+	for (const float DeviceZ : SceneDepth) {
+		Texels.Emplace(DeviceZ, DeviceZ, DeviceZ, DeviceZ);
+	}
+	TRefCountPtr<IPooledRenderTarget> DepthTarget;
+	GRenderTargetPool.FindFreeElement(RHICmdList, FPooledRenderTargetDesc::Create2DDesc(SceneDepthSize, PF_A32B32G32R32F, FClearValueBinding::None, TexCreate_None, TexCreate_ShaderResource, false), DepthTarget, TEXT("MobileHZBTestDepth"));
+	RHIUpdateTexture2D(DepthTarget->GetRenderTargetItem().ShaderResourceTexture->GetTexture2D(), 0, FUpdateTextureRegion2D(0, 0, 0, 0, SceneDepthSize.X, SceneDepthSize.Y), SceneDepthSize.X * sizeof(FLinearColor), reinterpret_cast<const uint8*>(Texels.GetData()));
+
+	//Standalone like a shadow cascade, nothing registers it and the destructor gives the storage back
+	FMobileHzbSystem System;
+	System.NumMips = Layout.NumMips;
+	System.HzbSize = Layout.HzbSize;
+	System.BufferLayout = Layout;
+	System.MobileHZBPooledBuffer = GMobileHzbBufferPool.Acquire(Layout.GetGPUElementCount(), GFrameNumberRenderThread, System.MobileHZBBufferSRV);
+
+	const FStagingBufferRHIRef StagingBuffer = RHICreateStagingBuffer();
+	const FGPUFenceRHIRef Fence = RHICreateGPUFence(TEXT("MobileHZBTestReadbackFence"));
+	const uint32 NumBytes = Layout.NumElements * Layout.GetElementBytes();
+	{
+		FRDGBuilder GraphBuilder(RHICmdList);
+		//HZB mip 0 texel -> UV of the whole depth texture
+		FMobileHzbBuildViews BuildViews;
+		BuildViews.Add(0, FVector4(1.f / Layout.HzbSize.X, 1.f / Layout.HzbSize.Y, 0.f, 0.f));
+		FRDGTextureRef SceneTexture = GraphBuilder.RegisterExternalTexture(DepthTarget, TEXT("MobileHZBTestDepth"));
+		System.AddBufferBuildPasses(GraphBuilder, GetGlobalShaderMap(GMaxRHIFeatureLevel), GMaxRHIShaderPlatform, SceneTexture, BuildViews, FIntRect(FIntPoint::ZeroValue, Layout.HzbSize));
+
+		FMobileHzbTestReadbackParameters* PassParameters = GraphBuilder.AllocParameters<FMobileHzbTestReadbackParameters>();
+		PassParameters->HzbBuffer = GraphBuilder.RegisterExternalBuffer(System.MobileHZBPooledBuffer, TEXT("MobileHZBBuffer"));
+		GraphBuilder.AddPass(
+			RDG_EVENT_NAME("MobileHZBTestReadback"),
+			PassParameters,
+			ERDGPassFlags::Readback,
+			[PassParameters, StagingBuffer, Fence, NumBytes](FRHICommandListImmediate& RHICmdList) {
+				RHICmdList.CopyToStagingBuffer(PassParameters->HzbBuffer->GetRHIStructuredBuffer(), StagingBuffer, 0, NumBytes);
+				RHICmdList.WriteGPUFence(Fence);
+			});
+		GraphBuilder.Execute();
+	}
+	//Test only, unlike the readback ring it waits for the GPU
+	RHICmdList.SubmitCommandsAndFlushGPU();
+	RHICmdList.BlockUntilGPUIdle();
+
+	OutHzbBuffer.SetNumZeroed(Layout.NumElements);
+	const void* Data = RHILockStagingBuffer(StagingBuffer, Fence, 0, NumBytes);
+	if (Layout.bPackedFP16) {
+		const FFloat16* SrcData = static_cast<const FFloat16*>(Data);
+		for (uint32 Index = 0; Index < Layout.NumElements; ++Index) {
+			OutHzbBuffer[Index] = SrcData[Index].GetFloat();
+		}
+	}
+	else {
+		FMemory::Memcpy(OutHzbBuffer.GetData(), Data, NumBytes);
+	}
+	RHIUnlockStagingBuffer(StagingBuffer);
+}
+
+namespace MobileHzbSelfTest
+{
+	enum class EFixture : uint8 {
+		Random,
+		AllNear,	//Everything culled unless it is at the near plane
+		AllFar,		//Nothing culled
+		FarEdges,	//Near scene with a far last row and column, the clamped edge texels must see them
+		Steps,		//Few distinct depths, many bounds sit exactly on an HZB value
+		Num,
+	};
+
+	static const TCHAR* GetFixtureName(const EFixture Fixture) {
+		switch (Fixture) {
+		case EFixture::Random: return TEXT("Random");
+		case EFixture::AllNear: return TEXT("AllNear");
+		case EFixture::AllFar: return TEXT("AllFar");
+		case EFixture::FarEdges: return TEXT("FarEdges");
+		case EFixture::Steps: return TEXT("Steps");
+		default: return TEXT("");
+		}
+	}
+
+	static void FillSceneDepth(const EFixture Fixture, const FIntPoint SceneDepthSize, FRandomStream& RandomStream, TArray<float>& OutSceneDepth) {
+		OutSceneDepth.SetNumUninitialized(SceneDepthSize.X * SceneDepthSize.Y);
+		for (int32 Y = 0; Y < SceneDepthSize.Y; ++Y) {
+			for (int32 X = 0; X < SceneDepthSize.X; ++X) {
+				float DeviceZ = 0.f;
+				switch (Fixture) {
+				case EFixture::Random: DeviceZ = RandomStream.FRand(); break;
+				case EFixture::AllNear: DeviceZ = 1.f; break;
+				case EFixture::AllFar: DeviceZ = 0.f; break;
+				case EFixture::FarEdges: DeviceZ = (X == SceneDepthSize.X - 1 || Y == SceneDepthSize.Y - 1) ? 0.f : 1.f; break;
+				case EFixture::Steps: DeviceZ = float(RandomStream.RandHelper(4)) * 0.25f; break;
+				default: break;
+				}
+				OutSceneDepth[Y * SceneDepthSize.X + X] = DeviceZ;
+			}
+		}
+	}
+
+	//Query bounds of the tests and the benchmark, Pow 3 extents give mostly small rects like the instances of a real scene. MaxZ is uniform, callers may override it
+	struct FQueryBoundsFixture {
+		TArray<float> NDCMinX, NDCMinY, NDCMaxX, NDCMaxY, MaxZ;
+		FMobileHzbQueryBatch GetBatch() const { return FMobileHzbQueryBatch{ NDCMinX, NDCMinY, NDCMaxX, NDCMaxY, MaxZ }; }
+	};
+
+	static void FillQueryBounds(const int32 NumBounds, const float MaxCenter, const float MaxExtent, FRandomStream& RandomStream, FQueryBoundsFixture& OutBounds) {
+		OutBounds.NDCMinX.SetNumUninitialized(NumBounds);
+		OutBounds.NDCMinY.SetNumUninitialized(NumBounds);
+		OutBounds.NDCMaxX.SetNumUninitialized(NumBounds);
+		OutBounds.NDCMaxY.SetNumUninitialized(NumBounds);
+		OutBounds.MaxZ.SetNumUninitialized(NumBounds);
+		for (int32 Index = 0; Index < NumBounds; ++Index) {
+			const FVector2D Center(RandomStream.FRandRange(-MaxCenter, MaxCenter), RandomStream.FRandRange(-MaxCenter, MaxCenter));
+			const FVector2D Extent(FMath::Pow(RandomStream.FRand(), 3.f) * MaxExtent, FMath::Pow(RandomStream.FRand(), 3.f) * MaxExtent);
+			OutBounds.NDCMinX[Index] = Center.X - Extent.X;
+			OutBounds.NDCMinY[Index] = Center.Y - Extent.Y;
+			OutBounds.NDCMaxX[Index] = Center.X + Extent.X;
+			OutBounds.NDCMaxY[Index] = Center.Y + Extent.Y;
+			OutBounds.MaxZ[Index] = RandomStream.FRand();
+		}
+	}
+
+	//Mip 0 of HZBBuildCSLevelZero, one texel at a time. Every other mip is taken from it by brute force, nothing is shared with a reduction
+	static void BuildReferenceMipZero(const FIntPoint HzbSize, const TArray<float>& SceneDepth, const FIntPoint SceneDepthSize, TArray<float>& OutMipZero) {
+		OutMipZero.SetNumUninitialized(HzbSize.X * HzbSize.Y);
+		for (int32 Y = 0; Y < HzbSize.Y; ++Y) {
+			for (int32 X = 0; X < HzbSize.X; ++X) {
+				//GatherRed at UV = Texel / HzbSize with a point clamp sampler
+				const int32 SrcX = FMath::FloorToInt(float(X) * (1.f / HzbSize.X) * SceneDepthSize.X - 0.5f);
+				const int32 SrcY = FMath::FloorToInt(float(Y) * (1.f / HzbSize.Y) * SceneDepthSize.Y - 0.5f);
+				float MinDepth = 1.f;
+				for (int32 TapY = SrcY; TapY <= SrcY + 1; ++TapY) {
+					for (int32 TapX = SrcX; TapX <= SrcX + 1; ++TapX) {
+						const int32 ClampedX = FMath::Clamp(TapX, 0, SceneDepthSize.X - 1);
+						const int32 ClampedY = FMath::Clamp(TapY, 0, SceneDepthSize.Y - 1);
+						MinDepth = FMath::Min(MinDepth, SceneDepth[ClampedY * SceneDepthSize.X + ClampedX]);
+					}
+				}
+				OutMipZero[Y * HzbSize.X + X] = MinDepth;
+			}
+		}
+	}
+
+	//Furthest depth of every mip 0 texel under texel (X, Y) of MipLevel
+	static float GetReferenceDepth(const TArray<float>& MipZero, const FIntPoint HzbSize, const int32 MipLevel, const int32 X, const int32 Y) {
+		const int32 MaxX = FMath::Min((X + 1) << MipLevel, HzbSize.X);
+		const int32 MaxY = FMath::Min((Y + 1) << MipLevel, HzbSize.Y);
+		float MinDepth = 1.f;
+		for (int32 TexelY = Y << MipLevel; TexelY < MaxY; ++TexelY) {
+			for (int32 TexelX = X << MipLevel; TexelX < MaxX; ++TexelX) {
+				MinDepth = FMath::Min(MinDepth, MipZero[TexelY * HzbSize.X + TexelX]);
+			}
+		}
+		return MinDepth;
+	}
+
+	static int32 CountPyramidMismatches(const FMobileHzbBufferLayout& Layout, const float* HzbBuffer, const TArray<float>& MipZero, const bool bQuantize) {
+		int32 NumMismatches = 0;
+		for (int32 MipLevel = 0; MipLevel < Layout.NumMips; ++MipLevel) {
+			const FIntPoint MipSize = Layout.GetMipSize(MipLevel);
+			for (int32 Y = 0; Y < MipSize.Y; ++Y) {
+				for (int32 X = 0; X < MipSize.X; ++X) {
+					const float Reference = GetReferenceDepth(MipZero, Layout.HzbSize, MipLevel, X, Y);
+					const float Expected = bQuantize ? FMobileHzbSystem::QuantizeFurthestDepth(Reference).GetFloat() : Reference;
+					NumMismatches += HzbBuffer[Layout.GetElementIndex(MipLevel, X, Y)] != Expected ? 1 : 0;
+				}
+			}
+		}
+		return NumMismatches;
+	}
+
+	//Mip and texels of the 4 corner taps plus the center tap
+	struct FReferenceTaps {
+		int32 SampleLevel;
+		uint32 Taps[5][2];
+	};
+
+	//Scalar IsVisibleHZBStorageBufferDownSampleUnreal4 taps, same float op order as the SIMD CPU query so the results can be compared bit for bit
+	static FReferenceTaps GetReferenceTaps(const FMobileHzbBufferLayout& Layout, const float MinX, const float MinY, const float MaxX, const float MaxY) {
+		const float Width = float(Layout.HzbSize.X);
+		const float Height = float(Layout.HzbSize.Y);
+		const float RectX0 = MinX * 0.5f + 0.5f;
+		const float RectY0 = MaxY * -0.5f + 0.5f;
+		const float RectX1 = MaxX * 0.5f + 0.5f;
+		const float RectY1 = MinY * -0.5f + 0.5f;
+		const float MaxRectSize = FMath::Max((RectX1 - RectX0) * (Width * 0.5f), (RectY1 - RectY0) * (Height * 0.5f));
+
+		//ceil(log2(MaxRectSize)) clamped to the chain, smallest level whose texel covers MaxRectSize
+		int32 SampleLevel = 0;
+		while (SampleLevel < Layout.NumMips - 1 && float(1 << SampleLevel) < MaxRectSize) {
+			++SampleLevel;
+		}
+
+		const uint32 X0 = uint32(FMath::RoundHalfToEven(FMath::Clamp(RectX0 * Width - 0.5f, 0.f, Width - 1.f)));
+		const uint32 Y0 = uint32(FMath::RoundHalfToEven(FMath::Clamp(RectY0 * Height - 0.5f, 0.f, Height - 1.f)));
+		const uint32 X1 = uint32(FMath::RoundHalfToEven(FMath::Clamp(RectX1 * Width - 0.5f, 0.f, Width - 1.f)));
+		const uint32 Y1 = uint32(FMath::RoundHalfToEven(FMath::Clamp(RectY1 * Height - 0.5f, 0.f, Height - 1.f)));
+		return { SampleLevel, {
+			{ X0 >> SampleLevel, Y0 >> SampleLevel },
+			{ X1 >> SampleLevel, Y0 >> SampleLevel },
+			{ X0 >> SampleLevel, Y1 >> SampleLevel },
+			{ X1 >> SampleLevel, Y1 >> SampleLevel },
+			{ (X0 + X1) >> (SampleLevel + 1), (Y0 + Y1) >> (SampleLevel + 1) },
+		} };
+	}
+
+	//The taps read mip 0 by brute force, a wrong mip offset or a bad reduction can't cancel out
+	static bool ReferenceQuery(const FMobileHzbBufferLayout& Layout, const TArray<float>& MipZero, const float MinX, const float MinY, const float MaxX, const float MaxY, const float MaxZ) {
+		const FReferenceTaps Taps = GetReferenceTaps(Layout, MinX, MinY, MaxX, MaxY);
+		float MinDepth = 1.f;
+		for (const uint32* Tap : Taps.Taps) {
+			MinDepth = FMath::Min(MinDepth, GetReferenceDepth(MipZero, Layout.HzbSize, Taps.SampleLevel, Tap[0], Tap[1]));
+		}
+		return MinDepth <= MaxZ;
+	}
+
+	//True when some mip 0 texel under the rect is not behind MaxZ. The 5 taps don't cover every texel of the footprint, a miss here is by design, not a failure
+	static bool IsVisibleInMipZero(const FMobileHzbBufferLayout& Layout, const TArray<float>& MipZero, const float MinX, const float MinY, const float MaxX, const float MaxY, const float MaxZ) {
+		const FIntPoint Size = Layout.HzbSize;
+		const int32 TexelX0 = FMath::Clamp(FMath::FloorToInt((MinX * 0.5f + 0.5f) * Size.X), 0, Size.X - 1);
+		const int32 TexelY0 = FMath::Clamp(FMath::FloorToInt((0.5f - MaxY * 0.5f) * Size.Y), 0, Size.Y - 1);
+		const int32 TexelX1 = FMath::Clamp(FMath::CeilToInt((MaxX * 0.5f + 0.5f) * Size.X) - 1, 0, Size.X - 1);
+		const int32 TexelY1 = FMath::Clamp(FMath::CeilToInt((0.5f - MinY * 0.5f) * Size.Y) - 1, 0, Size.Y - 1);
+		for (int32 Y = TexelY0; Y <= TexelY1; ++Y) {
+			for (int32 X = TexelX0; X <= TexelX1; ++X) {
+				if (MipZero[Y * Size.X + X] <= MaxZ) {
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	struct FSelfTestResult {
+		int32 NumPyramids = 0;
+		int32 NumPyramidMismatches = 0;
+		int32 NumQueries = 0;
+		int32 NumQueryMismatches = 0;	//SIMD query vs scalar reference, or between FP32 layouts
+		int32 NumQuantizeFailures = 0;	//Visible against the FP32 HZB but culled by the FP16 one
+		int32 NumFixtureFailures = 0;	//AllNear kept or AllFar culled something
+		int32 NumFootprintMisses = 0;	//Informational
+		int32 NumShaderTableMismatches = 0;
+	};
+
+	//HZBFixedMipOffset of MobileHZB.ush is generated from GetFixedMipOffset, it has to match the row-major layout of the fixed size
+	static int32 ValidateShaderTables() {
+		const FMobileHzbBufferLayout FixedLayout(FIntPoint(FMobileHzbSystem::kHzbTexWidth, FMobileHzbSystem::kHzbTexHeight), FMobileHzbSystem::kHZBMaxMipmap);
+		int32 NumMismatches = 0;
+		for (int32 MipLevel = 0; MipLevel < FMobileHzbSystem::kHZBMaxMipmap; ++MipLevel) {
+			NumMismatches += FixedLayout.GetMipOffset(MipLevel) != FMobileHzbSystem::GetFixedMipOffset(MipLevel) || FixedLayout.GetMipSize(MipLevel).X != (FMobileHzbSystem::kHzbTexWidth >> MipLevel) ? 1 : 0;
+		}
+		return NumMismatches;
+	}
+
+	//Rounding direction for every half in [0, 1], the floats right around it and the midpoint to the next one
+	static int32 CountQuantizeRoundingFailures(int32& OutNumSamples) {
+		int32 NumFailures = 0;
+		const uint16 OneEncoded = FFloat16(1.f).Encoded;
+		for (uint16 Encoded = 0; Encoded <= OneEncoded; ++Encoded) {
+			FFloat16 Half, NextHalf;
+			Half.Encoded = Encoded;
+			NextHalf.Encoded = Encoded + 1;
+			const float Value = Half.GetFloat();
+			const float Samples[] = { Value, nextafterf(Value, 0.f), nextafterf(Value, 2.f), (Value + NextHalf.GetFloat()) * 0.5f };
+			for (const float Sample : Samples) {
+				if (Sample < 0.f || Sample > 1.f) {
+					continue;
+				}
+				++OutNumSamples;
+				NumFailures += FMobileHzbSystem::QuantizeFurthestDepth(Sample).GetFloat() > Sample ? 1 : 0;
+				NumFailures += FMobileHzbSystem::QuantizeClosestDepth(Sample).GetFloat() < Sample ? 1 : 0;
+			}
+		}
+		return NumFailures;
+	}
+
+	//Random scenes and bounds, everything visible against the FP32 HZB has to stay visible against the quantized one
+	static int32 CountQuantizeVisibilityFailures(const int32 NumScenes, const int32 NumBounds, int32& OutNumVisible) {
+		const FMobileHzbBufferLayout& Layout = FMobileHzbSystem::GetDefaultBufferLayout();
+		const FIntPoint SceneDepthSize = Layout.HzbSize * 2;
+		FRandomStream RandomStream(0x4D48); //Deterministic, a failure can be reproduced
+
+		TArray<float> SceneDepth, HzbBuffer, QuantizedHzbBuffer;
+		FQueryBoundsFixture Bounds;
+		TArray<uint32> VisibilityMask, QuantizedVisibilityMask;
+		SceneDepth.SetNumUninitialized(SceneDepthSize.X * SceneDepthSize.Y);
+		HzbBuffer.SetNumUninitialized(Layout.NumElements);
+		QuantizedHzbBuffer.SetNumUninitialized(Layout.NumElements);
+
+		int32 NumFailures = 0;
+		for (int32 SceneIndex = 0; SceneIndex < NumScenes; ++SceneIndex) {
+			//Clustered depths so many bounds land right on a quantization step
+			for (float& DeviceZ : SceneDepth) {
+				DeviceZ = RandomStream.FRand() < 0.1f ? 0.f : FMath::Pow(RandomStream.FRand(), 4.f);
+			}
+			FMobileHzbSystem::MobileCpuBuildHZB(Layout, SceneDepth.GetData(), SceneDepthSize, HzbBuffer.GetData());
+			for (uint32 Index = 0; Index < Layout.NumElements; ++Index) {
+				QuantizedHzbBuffer[Index] = FMobileHzbSystem::QuantizeFurthestDepth(HzbBuffer[Index]).GetFloat();
+			}
+
+			FillQueryBounds(NumBounds, 1.f, 0.5f, RandomStream, Bounds);
+			for (int32 BoundsIndex = 0; BoundsIndex < NumBounds; ++BoundsIndex) {
+				//Half of the bounds sit exactly on an HZB value, the worst case for the rounding
+				Bounds.MaxZ[BoundsIndex] = (BoundsIndex & 1) ? HzbBuffer[RandomStream.RandHelper(Layout.NumElements)] : FMath::Pow(RandomStream.FRand(), 4.f);
+			}
+
+			const FMobileHzbQueryBatch Batch = Bounds.GetBatch();
+			FMobileHzbSystem::MobileCpuQueryVisibility(Layout, HzbBuffer.GetData(), Batch, VisibilityMask);
+			FMobileHzbSystem::MobileCpuQueryVisibility(Layout, QuantizedHzbBuffer.GetData(), Batch, QuantizedVisibilityMask);
+			for (int32 WordIndex = 0; WordIndex < VisibilityMask.Num(); ++WordIndex) {
+				OutNumVisible += FMath::CountBits(VisibilityMask[WordIndex]);
+				NumFailures += FMath::CountBits(VisibilityMask[WordIndex] & ~QuantizedVisibilityMask[WordIndex]);
+			}
+		}
+		return NumFailures;
+	}
+
+	static void RunFixture(const EFixture Fixture, const FIntPoint HzbSize, const FIntPoint SceneDepthSize, const int32 NumBounds, FRandomStream& RandomStream, FSelfTestResult& InOutResult) {
+		const int32 NumMips = FMath::Min<int32>(FMath::FloorLog2(FMath::Max(HzbSize.X, HzbSize.Y)) + 1, FMobileHzbBufferLayout::kMaxMipCount);
+		const FMobileHzbBufferLayout Layouts[] = {
+			FMobileHzbBufferLayout(HzbSize, NumMips),
+			FMobileHzbBufferLayout(HzbSize, NumMips, false, false, true),
+			FMobileHzbBufferLayout(HzbSize, NumMips, false, true),
+			FMobileHzbBufferLayout(HzbSize, NumMips, false, true, true),
+		};
+
+		TArray<float> SceneDepth;
+		FillSceneDepth(Fixture, SceneDepthSize, RandomStream, SceneDepth);
+		TArray<float> MipZero;
+		BuildReferenceMipZero(HzbSize, SceneDepth, SceneDepthSize, MipZero);
+
+		//Partly off screen and every rect size up to the whole screen
+		FQueryBoundsFixture Bounds;
+		FillQueryBounds(NumBounds, 1.2f, 1.2f, RandomStream, Bounds);
+		for (float& MaxZ : Bounds.MaxZ) {
+			MaxZ = Fixture == EFixture::Steps ? float(RandomStream.RandHelper(4)) * 0.25f : MaxZ * 0.999f;
+		}
+		const FMobileHzbQueryBatch Batch = Bounds.GetBatch();
+
+		TArray<float> HzbBuffer;
+		TArray<uint32> VisibilityMask, FirstVisibilityMask;
+		for (const FMobileHzbBufferLayout& Layout : Layouts) {
+			HzbBuffer.SetNumZeroed(Layout.NumElements);
+			FMobileHzbSystem::MobileCpuBuildHZB(Layout, SceneDepth.GetData(), SceneDepthSize, HzbBuffer.GetData());
+			++InOutResult.NumPyramids;
+			InOutResult.NumPyramidMismatches += CountPyramidMismatches(Layout, HzbBuffer.GetData(), MipZero, false);
+
+			if (Layout.bPackedFP16) {
+				//What the GPU stores, quantizing mip 0 then reducing has to give the quantized reference chain
+				for (int32 MipLevel = 0; MipLevel < Layout.NumMips; ++MipLevel) {
+					const FIntPoint MipSize = Layout.GetMipSize(MipLevel);
+					for (int32 Y = 0; Y < MipSize.Y; ++Y) {
+						for (int32 X = 0; X < MipSize.X; ++X) {
+							float& DeviceZ = HzbBuffer[Layout.GetElementIndex(MipLevel, X, Y)];
+							DeviceZ = MipLevel == 0 ? FMobileHzbSystem::QuantizeFurthestDepth(DeviceZ).GetFloat() : 0.f;
+						}
+					}
+				}
+				FMobileHzbSystem::MobileCpuReduceMips(Layout, HzbBuffer.GetData(), 1);
+				InOutResult.NumPyramidMismatches += CountPyramidMismatches(Layout, HzbBuffer.GetData(), MipZero, true);
+			}
+
+			FMobileHzbSystem::MobileCpuQueryVisibility(Layout, HzbBuffer.GetData(), Batch, VisibilityMask);
+			if (Layout.bPackedFP16) {
+				//Not bit exact, the FP16 HZB only has to be conservative. The FP32 layouts come first
+				for (int32 WordIndex = 0; WordIndex < VisibilityMask.Num(); ++WordIndex) {
+					InOutResult.NumQuantizeFailures += FMath::CountBits(FirstVisibilityMask[WordIndex] & ~VisibilityMask[WordIndex]);
+				}
+				continue;
+			}
+			const bool bFirstLayout = FirstVisibilityMask.Num() == 0;
+			for (int32 Index = 0; Index < NumBounds; ++Index) {
+				const bool bVisible = (VisibilityMask[Index >> 5] & (1u << (Index & 31))) != 0;
+				if (bFirstLayout) {
+					const bool bReferenceVisible = ReferenceQuery(Layout, MipZero, Bounds.NDCMinX[Index], Bounds.NDCMinY[Index], Bounds.NDCMaxX[Index], Bounds.NDCMaxY[Index], Bounds.MaxZ[Index]);
+					InOutResult.NumQueryMismatches += bVisible != bReferenceVisible ? 1 : 0;
+					InOutResult.NumFixtureFailures += (Fixture == EFixture::AllFar && !bVisible) || (Fixture == EFixture::AllNear && bVisible) ? 1 : 0;
+					InOutResult.NumFootprintMisses += !bVisible && IsVisibleInMipZero(Layout, MipZero, Bounds.NDCMinX[Index], Bounds.NDCMinY[Index], Bounds.NDCMaxX[Index], Bounds.NDCMaxY[Index], Bounds.MaxZ[Index]) ? 1 : 0;
+					++InOutResult.NumQueries;
+				}
+			}
+			if (bFirstLayout) {
+				FirstVisibilityMask = VisibilityMask;
+			}
+			else {
+				for (int32 WordIndex = 0; WordIndex < VisibilityMask.Num(); ++WordIndex) {
+					InOutResult.NumQueryMismatches += FMath::CountBits(VisibilityMask[WordIndex] ^ FirstVisibilityMask[WordIndex]);
+				}
+			}
+		}
+	}
+
+	static constexpr uint32 kCacheLineBytes = 64;
+
+	static uint32 GetCacheLine(const FMobileHzbBufferLayout& Layout, const int32 MipLevel, const int32 X, const int32 Y) {
+		return Layout.GetElementIndex(MipLevel, X, Y) * Layout.GetElementBytes() / kCacheLineBytes;
+	}
+
+	//Distinct cache lines of the 5 query taps, averaged over the batch
+	static double CountQueryCacheLines(const FMobileHzbBufferLayout& Layout, const FQueryBoundsFixture& Bounds) {
+		uint64 NumLines = 0;
+		for (int32 Index = 0; Index < Bounds.MaxZ.Num(); ++Index) {
+			const FReferenceTaps Taps = GetReferenceTaps(Layout, Bounds.NDCMinX[Index], Bounds.NDCMinY[Index], Bounds.NDCMaxX[Index], Bounds.NDCMaxY[Index]);
+			TArray<uint32, TInlineAllocator<5>> Lines;
+			for (const uint32* Tap : Taps.Taps) {
+				Lines.AddUnique(GetCacheLine(Layout, Taps.SampleLevel, Tap[0], Tap[1]));
+			}
+			NumLines += Lines.Num();
+		}
+		return double(NumLines) / FMath::Max(Bounds.MaxZ.Num(), 1);
+	}
+
+	//Distinct parent cache lines read by one 8x8 HZBBuildCSLevelOne group building mip 1, averaged over the groups
+	static double CountReduceCacheLines(const FMobileHzbBufferLayout& Layout) {
+		const int32 GroupTileSize = FMobileHzbSystem::GroupTileSize;
+		const FIntPoint ParentSize = Layout.GetMipSize(0);
+		const FIntPoint MipSize = Layout.GetMipSize(1);
+		const FIntPoint NumGroups(FMath::DivideAndRoundUp(MipSize.X, GroupTileSize), FMath::DivideAndRoundUp(MipSize.Y, GroupTileSize));
+		uint64 NumLines = 0;
+		TSet<uint32> Lines;
+		for (int32 GroupY = 0; GroupY < NumGroups.Y; ++GroupY) {
+			for (int32 GroupX = 0; GroupX < NumGroups.X; ++GroupX) {
+				Lines.Reset();
+				for (int32 Y = 0; Y < GroupTileSize * 2; ++Y) {
+					for (int32 X = 0; X < GroupTileSize * 2; ++X) {
+						const int32 ParentX = FMath::Min(GroupX * GroupTileSize * 2 + X, ParentSize.X - 1);
+						const int32 ParentY = FMath::Min(GroupY * GroupTileSize * 2 + Y, ParentSize.Y - 1);
+						Lines.Add(GetCacheLine(Layout, 0, ParentX, ParentY));
+					}
+				}
+				NumLines += Lines.Num();
+			}
+		}
+		return double(NumLines) / FMath::Max(NumGroups.X * NumGroups.Y, 1);
+	}
+
+	//CPU build and query cost plus cache line touches per resolution and layout. The GPU paths are timed by the MobileHZBBuild/MobileHZBReduceMips GPU stats
+	static void RunBenchmark(const int32 NumBounds, const int32 NumIterations) {
+		const FIntPoint HzbSizes[] = { FIntPoint(128, 64), FIntPoint(256, 128), FIntPoint(512, 256), FIntPoint(1024, 512) };
+		FRandomStream RandomStream(0x4D48);
+		TArray<float> SceneDepth, HzbBuffer;
+		TArray<uint32> VisibilityMask;
+		FQueryBoundsFixture Bounds;
+		FillQueryBounds(NumBounds, 1.f, 0.25f, RandomStream, Bounds);
+		const FMobileHzbQueryBatch Batch = Bounds.GetBatch();
+
+		for (const FIntPoint HzbSize : HzbSizes) {
+			const int32 NumMips = FMath::Min<int32>(FMath::FloorLog2(HzbSize.X), FMobileHzbBufferLayout::kMaxMipCount);
+			const FIntPoint SceneDepthSize = HzbSize * 2;
+			FillSceneDepth(EFixture::Random, SceneDepthSize, RandomStream, SceneDepth);
+			const FMobileHzbBufferLayout Layouts[] = {
+				FMobileHzbBufferLayout(HzbSize, NumMips),
+				FMobileHzbBufferLayout(HzbSize, NumMips, false, false, true),
+				FMobileHzbBufferLayout(HzbSize, NumMips, false, true),
+				FMobileHzbBufferLayout(HzbSize, NumMips, false, true, true),
+			};
+			for (const FMobileHzbBufferLayout& Layout : Layouts) {
+				HzbBuffer.SetNumZeroed(Layout.NumElements);
+
+				double StartTime = FPlatformTime::Seconds();
+				for (int32 Iteration = 0; Iteration < NumIterations; ++Iteration) {
+					FMobileHzbSystem::MobileCpuBuildHZB(Layout, SceneDepth.GetData(), SceneDepthSize, HzbBuffer.GetData());
+				}
+				const double BuildTime = FPlatformTime::Seconds() - StartTime;
+
+				StartTime = FPlatformTime::Seconds();
+				for (int32 Iteration = 0; Iteration < NumIterations; ++Iteration) {
+					FMobileHzbSystem::MobileCpuQueryVisibility(Layout, HzbBuffer.GetData(), Batch, VisibilityMask);
+				}
+				const double QueryTime = FPlatformTime::Seconds() - StartTime;
+
+				//The CPU HZB is always FP32, FP16 only changes the GPU element size and so the cache lines
+				UE_LOG(LogRenderer, Display, TEXT("MobileHZB Benchmark %dx%d %s %s: CPU build %.3f ms, CPU query %.1f MQueries/s, %.2f lines/query, %.1f lines/LevelOne group"),
+					HzbSize.X, HzbSize.Y,
+					Layout.bTiled ? TEXT("Tiled4x4") : TEXT("RowMajor"),
+					Layout.bPackedFP16 ? TEXT("FP16") : TEXT("FP32"),
+					BuildTime * 1000.0 / NumIterations,
+					double(NumBounds) * NumIterations / FMath::Max(QueryTime, 1e-6) * 1e-6,
+					CountQueryCacheLines(Layout, Bounds),
+					CountReduceCacheLines(Layout));
+			}
+		}
+	}
+
+	static void RunBenchmarkCommand(const TArray<FString>& Args) {
+		const int32 NumBounds = Args.Num() > 0 ? FMath::Max(FCString::Atoi(*Args[0]), 32) : 1 << 16;
+		const int32 NumIterations = Args.Num() > 1 ? FMath::Max(FCString::Atoi(*Args[1]), 1) : 8;
+		RunBenchmark(NumBounds, NumIterations);
+	}
+}
+
+static FAutoConsoleCommand GMobileHzbBenchmarkCommand(
+	TEXT("r.GpuDriven.MobileHZB.Benchmark"),
+	TEXT("CPU only, safe under NullRHI. Times the CPU build and query and counts the cache lines they touch per resolution and layout,\n")
+	TEXT("correctness is covered by the System.Renderer.MobileHZB automation tests. Args: [NumBounds=65536] [Iterations=8]"),
+	FConsoleCommandWithArgsDelegate::CreateStatic(&MobileHzbSelfTest::RunBenchmarkCommand)
+);
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FMobileHzbCpuTest, "System.Renderer.MobileHZB.Cpu", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+//Every CPU layout against the brute force reference pyramid and query on synthetic depth fixtures, plus the FP16 quantization. No RHI needed
+bool FMobileHzbCpuTest::RunTest(const FString& Parameters) {
+	using namespace MobileHzbSelfTest;
+	const int32 NumBounds = 4096;
+
+	//Odd viewports, smaller than the HZB, exactly 2x and a single texel
+	const FIntPoint HzbSizes[] = { FIntPoint(256, 128), FIntPoint(64, 64) };
+	const FIntPoint SceneDepthSizes[] = { FIntPoint(512, 256), FIntPoint(333, 187), FIntPoint(127, 63), FIntPoint(1, 1) };
+	FRandomStream RandomStream(0x4D48); //Deterministic, a failure can be reproduced
+	FSelfTestResult Result;
+	Result.NumShaderTableMismatches = ValidateShaderTables();
+	if (Result.NumShaderTableMismatches > 0) {
+		AddError(FString::Printf(TEXT("%d fixed mip offsets of the shader table differ from the row-major layout"), Result.NumShaderTableMismatches));
+	}
+
+	int32 NumRoundingSamples = 0;
+	const int32 NumRoundingFailures = CountQuantizeRoundingFailures(NumRoundingSamples);
+	if (NumRoundingFailures > 0) {
+		AddError(FString::Printf(TEXT("%d of %d FP16 depth quantizations round toward the camera"), NumRoundingFailures, NumRoundingSamples * 2));
+	}
+	int32 NumVisible = 0;
+	const int32 NumVisibilityFailures = CountQuantizeVisibilityFailures(16, NumBounds, NumVisible);
+	if (NumVisibilityFailures > 0) {
+		AddError(FString::Printf(TEXT("%d of %d bounds visible against the FP32 HZB are culled by the FP16 one"), NumVisibilityFailures, NumVisible));
+	}
+
+	for (const FIntPoint HzbSize : HzbSizes) {
+		for (const FIntPoint SceneDepthSize : SceneDepthSizes) {
+			for (int32 FixtureIndex = 0; FixtureIndex < int32(EFixture::Num); ++FixtureIndex) {
+				const FSelfTestResult Before = Result;
+				RunFixture(EFixture(FixtureIndex), HzbSize, SceneDepthSize, NumBounds, RandomStream, Result);
+				if (Result.NumPyramidMismatches != Before.NumPyramidMismatches || Result.NumQueryMismatches != Before.NumQueryMismatches || Result.NumQuantizeFailures != Before.NumQuantizeFailures || Result.NumFixtureFailures != Before.NumFixtureFailures) {
+					AddError(FString::Printf(TEXT("%s HZB %dx%d scene %dx%d: %d pyramid texel, %d query mismatches, %d culled by FP16, %d fixture failures"),
+						GetFixtureName(EFixture(FixtureIndex)), HzbSize.X, HzbSize.Y, SceneDepthSize.X, SceneDepthSize.Y,
+						Result.NumPyramidMismatches - Before.NumPyramidMismatches,
+						Result.NumQueryMismatches - Before.NumQueryMismatches,
+						Result.NumQuantizeFailures - Before.NumQuantizeFailures,
+						Result.NumFixtureFailures - Before.NumFixtureFailures));
+				}
+			}
+		}
+	}
+
+	AddInfo(FString::Printf(TEXT("%d pyramids, %d queries, %d footprint misses (5 tap query, informational)"), Result.NumPyramids, Result.NumQueries, Result.NumFootprintMisses));
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FMobileHzbGpuReadbackTest, "System.Renderer.MobileHZB.GpuReadback", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+//Every StorageBuffer build path and layout on the same synthetic depth, read back and compared with the first one. FP32 paths have to match bit for bit,
+//FP16 ones the quantized FP32 result, and every readback its own CPU reduction. The texture path is only compiled with bUseTextureResources
+bool FMobileHzbGpuReadbackTest::RunTest(const FString& Parameters) {
+	using namespace MobileHzbSelfTest;
+	if (FMobileHzbSystem::bUseTextureResources || !FApp::CanEverRender() || GMaxRHIFeatureLevel < ERHIFeatureLevel::ES3_1) {
+		AddWarning(TEXT("No StorageBuffer HZB build on this RHI, nothing to compare"));
+		return true;
+	}
+
+	const FMobileHzbBufferLayout& DefaultLayout = FMobileHzbSystem::GetDefaultBufferLayout();
+	const FIntPoint HzbSize = DefaultLayout.HzbSize;
+	const FIntPoint SceneDepthSize = HzbSize * 2;
+	FRandomStream RandomStream(0x4D48); //Deterministic, a failure can be reproduced
+	TArray<float> SceneDepth;
+	FillSceneDepth(EFixture::Random, SceneDepthSize, RandomStream, SceneDepth);
+
+	const FMobileHzbBufferLayout Layouts[] = {
+		FMobileHzbBufferLayout(HzbSize, DefaultLayout.NumMips),
+		FMobileHzbBufferLayout(HzbSize, DefaultLayout.NumMips, false, false, true),
+		FMobileHzbBufferLayout(HzbSize, DefaultLayout.NumMips, false, true),
+		FMobileHzbBufferLayout(HzbSize, DefaultLayout.NumMips, false, true, true),
+	};
+	//Wave ops fall back to LDS where the RHI has none, both then build the same way
+	struct FBuildPath {
+		const TCHAR* Name;
+		int32 BufferBuildMode;
+		int32 WaveOps;
+	};
+	const FBuildPath BuildPaths[] = {
+		{ TEXT("MultiPass"), 0, 0 },
+		{ TEXT("SinglePass"), 1, 0 },
+		{ TEXT("MultiPass WaveOps"), 0, 1 },
+		{ TEXT("SinglePass WaveOps"), 1, 1 },
+	};
+
+	//Render thread safe cvars, Set queues the new value ahead of the build command
+	IConsoleVariable* BuildModeVar = IConsoleManager::Get().FindConsoleVariable(TEXT("r.GpuDriven.MobileHZB.BufferBuildMode"));
+	IConsoleVariable* WaveOpsVar = IConsoleManager::Get().FindConsoleVariable(TEXT("r.GpuDriven.MobileHZB.WaveOps"));
+	const int32 PrevBuildMode = BuildModeVar->GetInt();
+	const int32 PrevWaveOps = WaveOpsVar->GetInt();
+
+	TArray<float> ReferenceBuffer, HzbBuffer;
+	for (const FBuildPath& BuildPath : BuildPaths) {
+		BuildModeVar->Set(BuildPath.BufferBuildMode, ECVF_SetByCode);
+		WaveOpsVar->Set(BuildPath.WaveOps, ECVF_SetByCode);
+		for (const FMobileHzbBufferLayout& Layout : Layouts) {
+			ENQUEUE_RENDER_COMMAND(MobileHzbGpuReadbackTest)([&Layout, &SceneDepth, SceneDepthSize, &HzbBuffer](FRHICommandListImmediate& RHICmdList) {
+				FMobileHzbSystem::BuildAndReadbackTestHzb(RHICmdList, Layout, SceneDepth, SceneDepthSize, HzbBuffer);
+			});
+			FlushRenderingCommands();
+
+			//The first path and layout is the reference of every other one
+			const bool bReference = ReferenceBuffer.Num() == 0;
+			int32 NumMismatches = 0;
+			for (int32 MipLevel = 0; MipLevel < Layout.NumMips && !bReference; ++MipLevel) {
+				const FIntPoint MipSize = Layout.GetMipSize(MipLevel);
+				for (int32 Y = 0; Y < MipSize.Y; ++Y) {
+					for (int32 X = 0; X < MipSize.X; ++X) {
+						const float Reference = ReferenceBuffer[Layouts[0].GetElementIndex(MipLevel, X, Y)];
+						const float Expected = Layout.bPackedFP16 ? FMobileHzbSystem::QuantizeFurthestDepth(Reference).GetFloat() : Reference;
+						NumMismatches += HzbBuffer[Layout.GetElementIndex(MipLevel, X, Y)] != Expected ? 1 : 0;
+					}
+				}
+			}
+			const int32 NumReduceMismatches = FMobileHzbSystem::CountReduceMismatches(Layout, HzbBuffer.GetData(), 0);
+			if (NumMismatches > 0 || NumReduceMismatches > 0) {
+				AddError(FString::Printf(TEXT("%s %dx%d %s %s: %d texels differ from %s RowMajor FP32, %d from the CPU reduction of its mip 0"),
+					BuildPath.Name, HzbSize.X, HzbSize.Y,
+					Layout.bTiled ? TEXT("Tiled4x4") : TEXT("RowMajor"),
+					Layout.bPackedFP16 ? TEXT("FP16") : TEXT("FP32"),
+					NumMismatches, BuildPaths[0].Name, NumReduceMismatches));
+			}
+			if (bReference) {
+				ReferenceBuffer = HzbBuffer;
+			}
+		}
+	}
+
+	BuildModeVar->Set(PrevBuildMode, ECVF_SetByCode);
+	WaveOpsVar->Set(PrevWaveOps, ECVF_SetByCode);
+	return true;
+}
+
+#endif
+#endif
@@ -0,0 +1,98 @@
+#include "MobileHZB.h"
+#include "SceneRendering.h"
+#include "ScenePrivate.h"
+
+TAutoConsoleVariable<int32> CVarMobileHZBShadowCasterCulling(
+	TEXT("r.GpuDriven.MobileHZB.ShadowCasterCulling"),
+	0,
+	TEXT("Build a light view HZB per shadow cascade from last frame's shadow depth and cull the casters hidden behind it.\n")
+	TEXT("Casters reaching outside the cascade they were tested against are always kept"),
+	ECVF_RenderThreadSafe
+);
+
+TAutoConsoleVariable<int32> CVarMobileHZBShadowResolution(
+	TEXT("r.GpuDriven.MobileHZB.ShadowResolution"),
+	256,
+	TEXT("Light view HZB mip 0 width per cascade, height follows the cascade aspect ratio. Never more than half of the cascade"),
+	ECVF_RenderThreadSafe
+);
+
+FMobileHzbBufferLayout FMobileHzbSystem::ComputeShadowBufferLayout(const FIntPoint CascadeSize) {
+	//Gather reduces 2x2 shadow texels, more than half of the cascade only gathers the same texels twice
+	const int32 RequestedWidth = CVarMobileHZBShadowResolution.GetValueOnRenderThread();
+	int32 Width = FMath::Min(RequestedWidth > 0 ? RequestedWidth : kHzbTexWidth, CascadeSize.X / 2);
+	Width = FMath::Clamp(Align(Width, GroupTileSize), kMinHzbSize, kMaxHzbSize);
+	int32 Height = FMath::DivideAndRoundUp(Width * FMath::Max(CascadeSize.Y, 1), FMath::Max(CascadeSize.X, 1));
+	Height = FMath::Clamp(Align(Height, GroupTileSize), GroupTileSize, kMaxHzbSize);
+
+	const int32 LayoutNumMips = FMath::Min<int32>(FMath::FloorLog2(FMath::Max(Width, Height)), FMobileHzbBufferLayout::kMaxMipCount);
+	//Furthest chain only, row-major float
+	return FMobileHzbBufferLayout(FIntPoint(Width, Height), LayoutNumMips);
+}
+
+//Inverted Z like the view HZB, the culling shader tests RectMax.z as the closest depth
+static FMatrix GetInvertedShadowWorldToClip(const FMatrix& WorldToShadowClip) {
+	return WorldToShadowClip * FMatrix(
+		FPlane(1.f, 0.f, 0.f, 0.f),
+		FPlane(0.f, 1.f, 0.f, 0.f),
+		FPlane(0.f, 0.f, -1.f, 0.f),
+		FPlane(0.f, 0.f, 1.f, 1.f));
+}
+
+void FMobileHzbSystem::AddBuildShadowHzbPasses(FRDGBuilder& GraphBuilder, const FViewInfo& View, FRDGTextureRef ShadowDepthTexture, TArrayView<const FMobileHzbShadowCascade> Cascades) {
+	if (CVarMobileHZBShadowCasterCulling.GetValueOnRenderThread() == 0 || FMobileHzbSystem::bUseTextureResources) {
+		return;
+	}
+	const FMobileHzbSystemRef FoundSystem = FMobileHzbSystem::GetHzbSystemByViewStateUniqueId(View.ViewState);
+	if (!FoundSystem || !ShadowDepthTexture) {
+		return;
+	}
+	RDG_EVENT_SCOPE(GraphBuilder, "MobileShadowHZB %d cascades", Cascades.Num());
+
+	const FIntPoint ShadowExtent = ShadowDepthTexture->Desc.Extent;
+	const FVector2D InvExtent(1.f / ShadowExtent.X, 1.f / ShadowExtent.Y);
+	FoundSystem->ShadowCascadeHzbs.SetNum(Cascades.Num());
+	for (int32 CascadeIndex = 0; CascadeIndex < Cascades.Num(); ++CascadeIndex) {
+		const FMobileHzbShadowCascade& Cascade = Cascades[CascadeIndex];
+		TUniquePtr<FMobileHzbSystem>& CascadeSystem = FoundSystem->ShadowCascadeHzbs[CascadeIndex];
+		if (!CascadeSystem.IsValid()) {
+			CascadeSystem = MakeUnique<FMobileHzbSystem>();
+			CascadeSystem->bLightViewHzb = true;
+		}
+
+		//Same storage as a view of its own, the pool hands it back when the view releases its cascades
+		const FMobileHzbBufferLayout Layout = ComputeShadowBufferLayout(Cascade.AtlasRect.Size());
+		if (!CascadeSystem->MobileHZBPooledBuffer.IsValid() || CascadeSystem->BufferLayout != Layout) {
+			CascadeSystem->NumMips = Layout.NumMips;
+			CascadeSystem->HzbSize = Layout.HzbSize;
+			CascadeSystem->BufferLayout = Layout;
+			CascadeSystem->ReleaseHzbBuffer();
+			CascadeSystem->MobileHZBPooledBuffer = GMobileHzbBufferPool.Acquire(Layout.GetGPUElementCount(), GFrameNumberRenderThread, CascadeSystem->MobileHZBBufferSRV);
+		}
+
+		//HZB mip 0 texel -> AtlasRect UV
+		FMobileHzbBuildViews BuildViews;
+		BuildViews.Add(0, FVector4(
+			float(Cascade.AtlasRect.Width()) / Layout.HzbSize.X * InvExtent.X,
+			float(Cascade.AtlasRect.Height()) / Layout.HzbSize.Y * InvExtent.Y,
+			Cascade.AtlasRect.Min.X * InvExtent.X,
+			Cascade.AtlasRect.Min.Y * InvExtent.Y));
+		CascadeSystem->AddBufferBuildPasses(GraphBuilder, View.ShaderMap, View.GetShaderPlatform(), ShadowDepthTexture, BuildViews, FIntRect(FIntPoint::ZeroValue, Layout.HzbSize));
+		CascadeSystem->LightViewWorldToClip = GetInvertedShadowWorldToClip(Cascade.WorldToShadowClip);
+		CascadeSystem->LastRenderFrame = GFrameNumberRenderThread;
+		CascadeSystem->bHzbViewMatricesValid = true;
+	}
+}
+
+bool FMobileHzbSystem::MobileCullShadowCasters(FRHICommandList& RHICmdList, const FViewInfo& View, const int32 CascadeIndex, FRHIShaderResourceView* InstanceBoundsSRV, const uint32 NumInstances, FRHIShaderResourceView* DrawBatchesSRV, const uint32 NumBatches, FMobileHzbInstanceCullingResult& OutResult) {
+	if (CVarMobileHZBShadowCasterCulling.GetValueOnRenderThread() == 0 || !ShadowCascadeHzbs.IsValidIndex(CascadeIndex)) {
+		return false;
+	}
+	//Built this frame, a cascade skipped by the renderer keeps the depth of a stale light space
+	FMobileHzbSystem* CascadeSystem = ShadowCascadeHzbs[CascadeIndex].Get();
+	if (!CascadeSystem || !CascadeSystem->bHzbViewMatricesValid || CascadeSystem->LastRenderFrame != GFrameNumberRenderThread) {
+		return false;
+	}
+	CascadeSystem->MobileCullInstances(RHICmdList, View, InstanceBoundsSRV, NumInstances, DrawBatchesSRV, NumBatches, OutResult, EMobileHzbCullingPhase::Single);
+	return true;
+}
@@ -0,0 +1,145 @@
+#include "MobileHZB.h"
+#include "ProfilingDebugging/CsvProfiler.h"
+
+TAutoConsoleVariable<int32> CVarMobileHZBStats(
+	TEXT("r.GpuDriven.MobileHZB.Stats"),
+	0,
+	TEXT("Count tested, culled and sampled mip per HZB query into STATGROUP_MobileHZB and the MobileHZB CSV category.\n")
+	TEXT("GPU culling switches to the HZB_STATS permutation, CPU queries pay one atomic per counter per chunk"),
+	ECVF_RenderThreadSafe
+);
+
+CSV_DEFINE_CATEGORY(MobileHZB, true);
+
+DECLARE_DWORD_COUNTER_STAT(TEXT("GPU Tested"), STAT_MobileHZB_GPUTested, STATGROUP_MobileHZB);
+DECLARE_DWORD_COUNTER_STAT(TEXT("GPU Frustum Culled"), STAT_MobileHZB_GPUFrustumCulled, STATGROUP_MobileHZB);
+DECLARE_DWORD_COUNTER_STAT(TEXT("GPU Occlusion Culled"), STAT_MobileHZB_GPUOcclusionCulled, STATGROUP_MobileHZB);
+DECLARE_DWORD_COUNTER_STAT(TEXT("GPU Closest Accepted"), STAT_MobileHZB_GPUClosestAccepted, STATGROUP_MobileHZB);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("GPU Average Query Mip"), STAT_MobileHZB_GPUAverageMip, STATGROUP_MobileHZB);
+DECLARE_DWORD_COUNTER_STAT(TEXT("CPU Tested"), STAT_MobileHZB_CPUTested, STATGROUP_MobileHZB);
+DECLARE_DWORD_COUNTER_STAT(TEXT("CPU Occlusion Culled"), STAT_MobileHZB_CPUOcclusionCulled, STATGROUP_MobileHZB);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("CPU Average Query Mip"), STAT_MobileHZB_CPUAverageMip, STATGROUP_MobileHZB);
+
+TGlobalResource<FMobileHzbStats> GMobileHzbStats;
+
+static float GetAverageQueryMip(const uint32* Counters) {
+	uint64 NumQueries = 0;
+	uint64 MipSum = 0;
+	for (int32 MipLevel = 0; MipLevel < FMobileHzbBufferLayout::kMaxMipCount; ++MipLevel) {
+		NumQueries += Counters[EMobileHzbStatCounter::FirstMipLevel + MipLevel];
+		MipSum += uint64(Counters[EMobileHzbStatCounter::FirstMipLevel + MipLevel]) * MipLevel;
+	}
+	return NumQueries > 0 ? float(double(MipSum) / NumQueries) : 0.f;
+}
+
+bool FMobileHzbStats::IsEnabled() {
+	return CVarMobileHZBStats.GetValueOnAnyThread() != 0;
+}
+
+void FMobileHzbStats::Tick(FRHICommandList& RHICmdList) {
+	check(IsInRenderingThread());
+	if (TickFrameNumber == GFrameNumberRenderThread || !IsEnabled()) {
+		return;
+	}
+	TickFrameNumber = GFrameNumberRenderThread;
+
+	//Oldest first, the newest one that landed wins. Never waits on the GPU
+	for (int32 Offset = 0; Offset < kNumReadbacks; ++Offset) {
+		const int32 Index = (ReadbackWriteIndex + Offset) % kNumReadbacks;
+		if (bReadbackPending[Index] && Readbacks[Index]->IsReady()) {
+			const void* Data = Readbacks[Index]->Lock(sizeof(LatestGPUCounters));
+			FMemory::Memcpy(LatestGPUCounters, Data, sizeof(LatestGPUCounters));
+			Readbacks[Index]->Unlock();
+			bReadbackPending[Index] = false;
+		}
+	}
+
+	//Counters of the previous frame, dropped when every slot is still in flight
+	if (bGPUCountersWritten && !bReadbackPending[ReadbackWriteIndex]) {
+		if (!Readbacks[ReadbackWriteIndex].IsValid()) {
+			Readbacks[ReadbackWriteIndex] = MakeUnique<FRHIGPUBufferReadback>(TEXT("MobileHZBStatsReadback"));
+		}
+		RHICmdList.Transition(FRHITransitionInfo(GPUCounters.UAV, GPUCounterAccess, ERHIAccess::CopySrc));
+		GPUCounterAccess = ERHIAccess::CopySrc;
+		Readbacks[ReadbackWriteIndex]->EnqueueCopy(RHICmdList, GPUCounters.Buffer, sizeof(LatestGPUCounters));
+		bReadbackPending[ReadbackWriteIndex] = true;
+		ReadbackWriteIndex = (ReadbackWriteIndex + 1) % kNumReadbacks;
+	}
+	bGPUCountersWritten = false;
+
+	uint32 FrameCPUCounters[EMobileHzbStatCounter::Num];
+	for (int32 Index = 0; Index < EMobileHzbStatCounter::Num; ++Index) {
+		FrameCPUCounters[Index] = uint32(CPUCounters[Index].Reset());
+	}
+	Publish(LatestGPUCounters, FrameCPUCounters);
+}
+
+FRHIUnorderedAccessView* FMobileHzbStats::GetGPUCounterUAV(FRHICommandList& RHICmdList) {
+	Tick(RHICmdList);
+	if (GPUCounters.NumBytes == 0) {
+		GPUCounters.Initialize(sizeof(uint32), EMobileHzbStatCounter::Num, PF_R32_UINT, BUF_Static, TEXT("MobileHZBStatsCounters"));
+		GPUCounterAccess = ERHIAccess::Unknown;
+	}
+	if (ClearFrameNumber != GFrameNumberRenderThread) {
+		ClearFrameNumber = GFrameNumberRenderThread;
+		RHICmdList.Transition(FRHITransitionInfo(GPUCounters.UAV, GPUCounterAccess, ERHIAccess::UAVCompute));
+		RHICmdList.ClearUAVUint(GPUCounters.UAV, FUintVector4(0, 0, 0, 0));
+		RHICmdList.Transition(FRHITransitionInfo(GPUCounters.UAV, ERHIAccess::UAVCompute, ERHIAccess::UAVCompute));
+		GPUCounterAccess = ERHIAccess::UAVCompute;
+	}
+	bGPUCountersWritten = true;
+	return GPUCounters.UAV;
+}
+
+void FMobileHzbStats::AddCPUCounters(const uint32* Counters) {
+	for (int32 Index = 0; Index < EMobileHzbStatCounter::Num; ++Index) {
+		if (Counters[Index] != 0) {
+			CPUCounters[Index].Add(int32(Counters[Index]));
+		}
+	}
+}
+
+void FMobileHzbStats::Publish(const uint32* InGPUCounters, const uint32* InCPUCounters) {
+	SET_DWORD_STAT(STAT_MobileHZB_GPUTested, InGPUCounters[EMobileHzbStatCounter::Tested]);
+	SET_DWORD_STAT(STAT_MobileHZB_GPUFrustumCulled, InGPUCounters[EMobileHzbStatCounter::FrustumCulled]);
+	SET_DWORD_STAT(STAT_MobileHZB_GPUOcclusionCulled, InGPUCounters[EMobileHzbStatCounter::OcclusionCulled]);
+	SET_DWORD_STAT(STAT_MobileHZB_GPUClosestAccepted, InGPUCounters[EMobileHzbStatCounter::ClosestAccepted]);
+	SET_FLOAT_STAT(STAT_MobileHZB_GPUAverageMip, GetAverageQueryMip(InGPUCounters));
+	SET_DWORD_STAT(STAT_MobileHZB_CPUTested, InCPUCounters[EMobileHzbStatCounter::Tested]);
+	SET_DWORD_STAT(STAT_MobileHZB_CPUOcclusionCulled, InCPUCounters[EMobileHzbStatCounter::OcclusionCulled]);
+	SET_FLOAT_STAT(STAT_MobileHZB_CPUAverageMip, GetAverageQueryMip(InCPUCounters));
+
+#if CSV_PROFILER
+	CSV_CUSTOM_STAT(MobileHZB, GPUTested, int32(InGPUCounters[EMobileHzbStatCounter::Tested]), ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(MobileHZB, GPUFrustumCulled, int32(InGPUCounters[EMobileHzbStatCounter::FrustumCulled]), ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(MobileHZB, GPUOcclusionCulled, int32(InGPUCounters[EMobileHzbStatCounter::OcclusionCulled]), ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(MobileHZB, GPUClosestAccepted, int32(InGPUCounters[EMobileHzbStatCounter::ClosestAccepted]), ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(MobileHZB, CPUTested, int32(InCPUCounters[EMobileHzbStatCounter::Tested]), ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(MobileHZB, CPUOcclusionCulled, int32(InCPUCounters[EMobileHzbStatCounter::OcclusionCulled]), ECsvCustomStatOp::Set);
+
+	//One column per mip, GPUMip0 ... CPUMip11
+	static FName GPUMipStatNames[FMobileHzbBufferLayout::kMaxMipCount];
+	static FName CPUMipStatNames[FMobileHzbBufferLayout::kMaxMipCount];
+	if (GPUMipStatNames[0].IsNone()) {
+		for (int32 MipLevel = 0; MipLevel < FMobileHzbBufferLayout::kMaxMipCount; ++MipLevel) {
+			GPUMipStatNames[MipLevel] = FName(*FString::Printf(TEXT("GPUMip%d"), MipLevel));
+			CPUMipStatNames[MipLevel] = FName(*FString::Printf(TEXT("CPUMip%d"), MipLevel));
+		}
+	}
+	for (int32 MipLevel = 0; MipLevel < FMobileHzbBufferLayout::kMaxMipCount; ++MipLevel) {
+		FCsvProfiler::RecordCustomStat(GPUMipStatNames[MipLevel], CSV_CATEGORY_INDEX(MobileHZB), int32(InGPUCounters[EMobileHzbStatCounter::FirstMipLevel + MipLevel]), ECsvCustomStatOp::Set);
+		FCsvProfiler::RecordCustomStat(CPUMipStatNames[MipLevel], CSV_CATEGORY_INDEX(MobileHZB), int32(InCPUCounters[EMobileHzbStatCounter::FirstMipLevel + MipLevel]), ECsvCustomStatOp::Set);
+	}
+#endif
+}
+
+void FMobileHzbStats::ReleaseDynamicRHI() {
+	GPUCounters.Release();
+	GPUCounterAccess = ERHIAccess::Unknown;
+	bGPUCountersWritten = false;
+	ClearFrameNumber = ~0u;
+	for (int32 Index = 0; Index < kNumReadbacks; ++Index) {
+		Readbacks[Index].Reset();
+		bReadbackPending[Index] = false;
+	}
+}
@@ -0,0 +1,140 @@
+#include "MobileHZB.h"
+#include "SceneRendering.h"
+#include "ScenePrivate.h"
+
+TAutoConsoleVariable<int32> CVarMobileHZBTemporalReuse(
+	TEXT("r.GpuDriven.MobileHZB.TemporalReuse"),
+	0,
+	TEXT("Reuse the HZB while the view and the scene primitive count are unchanged, StorageBuffer HZB rebuilds only the mip 0 tiles covered by MarkOccludersDirty bounds.\n")
+	TEXT("Occluder moves that are not reported to MarkOccludersDirty and depth changes of static occluders (WPO) stay stale until the next full build, see TemporalMaxReuseFrames"),
+	ECVF_RenderThreadSafe
+);
+
+TAutoConsoleVariable<int32> CVarMobileHZBTemporalMaxReuseFrames(
+	TEXT("r.GpuDriven.MobileHZB.TemporalMaxReuseFrames"),
+	30,
+	TEXT("Frames the HZB may be reused or partially rebuilt before a full build is forced, bounds how long unreported depth changes survive. 0 never forces one"),
+	ECVF_RenderThreadSafe
+);
+
+//Partial rebuild stops paying off once most of mip 0 is dirty
+static constexpr float kMaxPartialRebuildFraction = 0.5f;
+
+void FMobileHzbSystem::MarkOccludersDirty(const FBox& WorldBounds) {
+	check(IsInRenderingThread());
+	SystemRegistry.ForEach([&WorldBounds](FMobileHzbSystem& System) {
+		if (System.bAllOccludersDirty) {
+			return;
+		}
+		if (!WorldBounds.IsValid || System.DirtyOccluderBounds.Num() >= kMaxDirtyOccluderBounds) {
+			System.bAllOccludersDirty = true;
+			System.DirtyOccluderBounds.Empty();
+			return;
+		}
+		System.DirtyOccluderBounds.Add(WorldBounds);
+	});
+}
+
+//Primitive adds and removes aren't reported to MarkOccludersDirty yet, a changed count drops the history. INDEX_NONE without a scene never matches
+static int32 GetScenePrimitiveCount(const FViewInfo& View) {
+	const FScene* Scene = View.Family->Scene ? View.Family->Scene->GetRenderScene() : nullptr;
+	return Scene ? Scene->Primitives.Num() : INDEX_NONE;
+}
+
+//Only a bit-identical camera keeps mip 0 exact, the AA jitter is ignored like the one frame old HZB already does
+static bool IsSameHzbCamera(const FViewMatrices& A, const FViewMatrices& B) {
+	return A.GetViewMatrix().Equals(B.GetViewMatrix(), 0.f) && A.GetProjectionNoAAMatrix().Equals(B.GetProjectionNoAAMatrix(), 0.f);
+}
+
+//Mip 0 texels covered by WorldBounds, padded by one texel for the gather footprint. False when the bounds cross the near plane
+static bool GetHzbDirtyRect(const FViewInfo& View, const FIntPoint HzbSize, const FBox& WorldBounds, FIntPoint& InOutMin, FIntPoint& InOutMax) {
+	const FMatrix& WorldToClip = View.ViewMatrices.GetViewProjectionMatrix();
+	FVector2D NDCMin(1.f, 1.f);
+	FVector2D NDCMax(-1.f, -1.f);
+	for (int32 CornerIndex = 0; CornerIndex < 8; ++CornerIndex) {
+		const FVector Corner(
+			(CornerIndex & 1) ? WorldBounds.Max.X : WorldBounds.Min.X,
+			(CornerIndex & 2) ? WorldBounds.Max.Y : WorldBounds.Min.Y,
+			(CornerIndex & 4) ? WorldBounds.Max.Z : WorldBounds.Min.Z);
+		const FVector4 Clip = WorldToClip.TransformFVector4(FVector4(Corner, 1.f));
+		if (Clip.W <= 0.f) {
+			return false;
+		}
+		const FVector2D NDC(Clip.X / Clip.W, Clip.Y / Clip.W);
+		NDCMin = FVector2D::Min(NDCMin, NDC);
+		NDCMax = FVector2D::Max(NDCMax, NDC);
+	}
+
+	//Off screen, nothing the HZB covers changed
+	if (NDCMax.X < -1.f || NDCMax.Y < -1.f || NDCMin.X > 1.f || NDCMin.Y > 1.f) {
+		return true;
+	}
+
+	//NDC -> HZB UV, y flipped. The HZB covers the ViewRect
+	const FIntPoint TexelMin(
+		FMath::FloorToInt((NDCMin.X * 0.5f + 0.5f) * HzbSize.X) - 1,
+		FMath::FloorToInt((0.5f - NDCMax.Y * 0.5f) * HzbSize.Y) - 1);
+	const FIntPoint TexelMax(
+		FMath::CeilToInt((NDCMax.X * 0.5f + 0.5f) * HzbSize.X) + 1,
+		FMath::CeilToInt((0.5f - NDCMin.Y * 0.5f) * HzbSize.Y) + 1);
+	InOutMin = InOutMin.ComponentMin(TexelMin);
+	InOutMax = InOutMax.ComponentMax(TexelMax);
+	return true;
+}
+
+EMobileHzbTemporalUpdate FMobileHzbSystem::ConsumeTemporalUpdate(const FViewInfo& View, FIntRect& OutDirtyRect) {
+	const bool bAllDirty = bAllOccludersDirty;
+	const TArray<FBox> DirtyBounds = MoveTemp(DirtyOccluderBounds);
+	DirtyOccluderBounds.Reset();
+	bAllOccludersDirty = false;
+
+	const int32 MaxReuseFrames = CVarMobileHZBTemporalMaxReuseFrames.GetValueOnRenderThread();
+	const int32 NumPrimitives = GetScenePrimitiveCount(View);
+	const bool bHistoryValid = CVarMobileHZBTemporalReuse.GetValueOnRenderThread() != 0
+		&& bTemporalHistoryValid
+		&& bHzbViewMatricesValid
+		&& TemporalViewRect == View.ViewRect
+		&& (MaxReuseFrames <= 0 || GFrameNumberRenderThread - LastFullBuildFrame < uint32(MaxReuseFrames))
+		&& NumPrimitives != INDEX_NONE
+		&& NumPrimitives == TemporalNumPrimitives
+		&& IsSameHzbCamera(TemporalViewMatrices, View.ViewMatrices);
+
+	EMobileHzbTemporalUpdate TemporalUpdate = EMobileHzbTemporalUpdate::Full;
+	if (bHistoryValid && !bAllDirty) {
+		const FIntPoint HzbExtent = BufferLayout.HzbSize;
+		FIntPoint DirtyMin(MAX_int32, MAX_int32);
+		FIntPoint DirtyMax(MIN_int32, MIN_int32);
+		bool bCrossNearPlane = false;
+		for (const FBox& Bounds : DirtyBounds) {
+			if (!GetHzbDirtyRect(View, HzbExtent, Bounds, DirtyMin, DirtyMax)) {
+				bCrossNearPlane = true;
+				break;
+			}
+		}
+
+		//Whole tiles, LevelZero writes mip 0-3 of every 8x8 group
+		DirtyMin = FIntPoint(FMath::Max(DirtyMin.X, 0) / GroupTileSize * GroupTileSize, FMath::Max(DirtyMin.Y, 0) / GroupTileSize * GroupTileSize);
+		DirtyMax = FIntPoint(FMath::Min(Align(FMath::Max(DirtyMax.X, 0), GroupTileSize), HzbExtent.X), FMath::Min(Align(FMath::Max(DirtyMax.Y, 0), GroupTileSize), HzbExtent.Y));
+		const int64 DirtyArea = int64(FMath::Max(DirtyMax.X - DirtyMin.X, 0)) * FMath::Max(DirtyMax.Y - DirtyMin.Y, 0);
+
+		if (bCrossNearPlane) {
+			TemporalUpdate = EMobileHzbTemporalUpdate::Full;
+		}
+		else if (DirtyArea == 0) {
+			TemporalUpdate = EMobileHzbTemporalUpdate::Skip;
+		}
+		else if (!bUseTextureResources && DirtyArea <= int64(kMaxPartialRebuildFraction * HzbExtent.X * HzbExtent.Y)) {
+			OutDirtyRect = FIntRect(DirtyMin, DirtyMax);
+			TemporalUpdate = EMobileHzbTemporalUpdate::Partial;
+		}
+	}
+
+	if (TemporalUpdate == EMobileHzbTemporalUpdate::Full) {
+		TemporalViewMatrices = View.ViewMatrices;
+		TemporalViewRect = View.ViewRect;
+		TemporalNumPrimitives = NumPrimitives;
+		LastFullBuildFrame = GFrameNumberRenderThread;
+		bTemporalHistoryValid = true;
+	}
+	return TemporalUpdate;
+}